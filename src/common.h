@@ -6,34 +6,69 @@
 #include "asshelper.h"
 
 
-#define MAX_STACK_DEEP 46
+#define MAX_STACK_DEEP 46 // frames a stack keeps in stack_agg_map
+// frames unwound per sample, deeper stacks than MAX_STACK_DEEP only cost ring
+// buffer space for the frames they use
+#define MAX_UNWIND_DEEP 256
 #define STR_BUFFER_SIZE 128
+#define MAX_LUA_SOURCES 4096
 
+// unwind rows are indexed by ip >> UNWIND_PAGE_SHIFT, a page lists the rows
+// overlapping it, so a lookup is one hash access plus a short binary search.
+// a row covers at least one byte, so a page has at most 4097 rows
+#define UNWIND_PAGE_SHIFT 12
+#define UNWIND_PAGE_SEARCH 13
 
 
+
+// the registers the bpf unwinder restores, LREG is the register luaV_execute
+// keeps lua_State in (luaV_execute_t.lstate.reg)
+enum {
+    UNWIND_RULE_RBP,
+    UNWIND_RULE_RIP,
+    UNWIND_RULE_LREG,
+    UNWIND_RULES
+};
+
+// one unique unwind state, rows point at it by index
 typedef struct fde_state_t {
-    struct {
-        int from;
-        int value;
-    } saved_registers[DWARF_REGS];
-
-    unsigned long cfa_register;
-    unsigned long cfa_offset;
-    unsigned char cfa_expression; // true or false
+    int cfa_offset;
+    int rule_value[UNWIND_RULES];
+    unsigned char cfa_register;
+    unsigned char cfa_rule; // CFA_RULE_*
+    unsigned char cfa_arg; // threshold of CFA_RULE_PLT
+    unsigned char rule_from[UNWIND_RULES]; // REG_*
+    unsigned char rule_reg[UNWIND_RULES]; // base register of REG_ATEXP/REG_ISEXP
 } fde_state_t;
 
+typedef struct unwind_row_t {
+    unsigned long long ip;
+    unsigned int state; // index in fde_state_map
+    unsigned int reserved;
+} unwind_row_t;
+
+// the page belongs to a frame pointer build and no row in it saves the
+// lua_State register, so non-leaf frames can be unwound by the rbp chain
+#define UNWIND_PAGE_FP 1
+
+typedef struct unwind_page_t {
+    unsigned int first; // first row in fde_ip_map
+    unsigned short count;
+    unsigned short flags; // UNWIND_PAGE_*
+} unwind_page_t;
+
+// every object has its own pages, they point into the shared rows
+typedef struct unwind_page_key_t {
+    unsigned int obj;
+    unsigned int reserved;
+    unsigned long long page; // object relative ip >> UNWIND_PAGE_SHIFT
+} unwind_page_key_t;
+
 #define PROC_COMM_LEN 16
 
 
 typedef unsigned long long stack_trace_t[MAX_STACK_DEEP];
 
-typedef struct stacktrace_event_t {
-	unsigned int pid;
-	unsigned int cpu_id;
-	char comm[PROC_COMM_LEN];
-    unsigned int stack_map_idx;
-} stacktrace_event_t;
-
 
 typedef struct luaV_execute_t {
     unsigned long ip_start;
@@ -41,24 +76,77 @@ typedef struct luaV_execute_t {
     param_t lstate;
 } luaV_execute_t;
 
+// an executable mapping of a profiled process, ip - bias is the address in
+// the object whose unwind rows are shared by every process mapping it
+typedef struct proc_mapping_t {
+    unsigned long long start;
+    unsigned long long end;
+    unsigned long long bias;
+    unsigned int obj;
+    unsigned int reserved;
+} proc_mapping_t;
 
+// mappings of a process are binary searched, so a process can have at most
+// 2^MAX_MAPPING_SEARCH - 1 of them
+#define MAX_MAPPING_SEARCH 10
+
+// a profiled process, proc_info_map is keyed by tgid
+typedef struct proc_info_t {
+    luaV_execute_t lt;
+    unsigned int first_mapping; // in proc_mapping_map, sorted by start
+    unsigned int mapping_count;
+} proc_info_t;
+
+
+// a lua frame, the chunk name is interned in lua_source_map
 typedef struct lua_func_t {
     int lv_idx;
-    int flag; // ci flag
-    union {
-        struct {
-            char file[STR_BUFFER_SIZE];
-            int startline;
-            int endline;
-            int currline;
-        } l;
-        unsigned long long caddr;
-    } u;
+    int flag; // ci flag, -1 for a c function
+    unsigned int source; // chunk name id, index of lua_name_map, 0 is unknown
+    int startline;
+    int endline;
+    int currline; // -1 from bpf, filled in userspace from proto and pc
+    int pc;
+    unsigned long long proto; // Proto * in the target process
 } lua_func_t;
 
+typedef struct lua_source_t {
+    char name[STR_BUFFER_SIZE];
+} lua_source_t;
+
 typedef lua_func_t lua_stack_t[MAX_STACK_DEEP];
 
+// per-cpu health counters, index of stat_map
+enum {
+    STAT_SAMPLES,       // stacks unwound for a profiled process
+    STAT_LUA_COMPLETE,  // every lua thread on the native stack walked to its base
+    STAT_RINGBUF_DROP,  // ring buffer reservation failed, sample lost
+    STAT_AGG_FULL,      // stack_agg_map full, sent through the ring buffer
+    STAT_AGG_DROP,      // stack_agg_map full, an off-cpu or live heap stack is lost
+    STAT_REGS_FAIL,     // registers of the task could not be read
+    STAT_MAPPING_MISS,  // rip outside every mapping of the process
+    STAT_ROW_MISS,      // no unwind row for rip
+    STAT_NATIVE_READ,   // cfa or frame read from user memory failed
+    STAT_NATIVE_TRUNC,  // native stack deeper than MAX_UNWIND_DEEP
+    STAT_LUA_MISS,      // no luaV_execute frame found, no lua stack
+    STAT_LUA_READ,      // lua_State or CallInfo read failed
+    STAT_LUA_ABORT,     // Proto unreadable, the whole sample dropped
+    STAT_LUA_TRUNC,     // lua stack deeper than MAX_UNWIND_DEEP
+    STAT_LIVE_UNTRACKED, // live_alloc_map full, a sampled block is not charged
+    STAT_MAX
+};
+
+// wall-clock mode tags every stack with the state of its thread, 0 is untagged
+#define STACK_STATE_ONCPU 1
+#define STACK_STATE_OFFCPU 2
+
+// a stack in stack_agg_map, sizes are frame counts
 typedef struct proc_stack_t {
+	unsigned long long weight; // samples folded into this stack
+	int pid;
+	int tid; // only set in wall-clock mode, stacks are kept per thread
+	int state; // STACK_STATE_*
+	unsigned int service; // skynet service handle, 0 outside a dispatch
 	int kstack_sz;
 	int ustack_sz;
     int lstack_sz;
@@ -67,6 +155,107 @@ typedef struct proc_stack_t {
     lua_stack_t lstack;
 } proc_stack_t;
 
+// per-cpu scratch a sample is unwound into, same header as proc_stack_t
+typedef struct deep_stack_t {
+	unsigned long long weight;
+	int pid;
+	int tid;
+	int state;
+	unsigned int service;
+	int kstack_sz;
+	int ustack_sz;
+	int lstack_sz;
+	stack_trace_t kstack;
+	unsigned long long ustack[MAX_UNWIND_DEEP];
+	lua_func_t lstack[MAX_UNWIND_DEEP];
+} deep_stack_t;
+
+// variable length sample record, as sent through the ring buffer and kept by
+// userspace: the header is followed by kstack_sz + ustack_sz native frames and
+// then lstack_sz lua frames, so a record only pays for the frames it uses.
+typedef struct stack_sample_t {
+	unsigned int pid;
+	unsigned int tid;
+	unsigned int cpu_id;
+	unsigned int service; // skynet service handle, 0 outside a dispatch
+	char comm[PROC_COMM_LEN];
+	unsigned long long weight;
+	unsigned short kstack_sz;
+	unsigned short ustack_sz;
+	unsigned short lstack_sz;
+	unsigned short state; // STACK_STATE_*
+} stack_sample_t;
+
+// off-cpu mode: a thread of a profiled process that was switched out, its
+// stack already sits in stack_agg_map with weight 0 and is charged the blocked
+// nanoseconds when the thread runs again
+typedef struct offcpu_start_t {
+	unsigned long long ts;
+	unsigned long long hash; // key in stack_agg_map
+} offcpu_start_t;
+
+// latency histogram, slot i counts durations of [2^i, 2^(i+1)) us
+#define HIST_SLOTS 27
+
+typedef struct hist_t {
+	unsigned int slots[HIST_SLOTS];
+	unsigned long long count;
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+} hist_t;
+
+// latency mode: a lua function selected by chunk name id and linedefined
+typedef struct lat_filter_key_t {
+	unsigned int source;
+	int linedefined;
+} lat_filter_key_t;
+
+typedef struct func_hist_key_t {
+	unsigned int pid;
+	unsigned int reserved;
+	unsigned long long proto;
+} func_hist_key_t;
+
+// latency mode: call latency of one Proto of a process
+typedef struct func_hist_t {
+	hist_t hist;
+	unsigned int source;
+	int linedefined;
+} func_hist_t;
+
+// snapshot mode: a global_State of a process, the value is a lua_State seen
+// running in it
+typedef struct lua_global_key_t {
+	unsigned int pid;
+	unsigned int reserved;
+	unsigned long long g;
+} lua_global_key_t;
+
+// skynet: a service of a process, the value is its skynet_context
+typedef struct sky_service_key_t {
+	unsigned int pid;
+	unsigned int handle;
+} sky_service_key_t;
+
+// fnv constants of hash_stack in bpf and hash_sample in userspace
+#define STACK_HASH_SEED 0xcbf29ce484222325ULL
+#define STACK_HASH_PRIME 0x100000001b3ULL
+
+#define SAMPLE_KSTACK(s) ((unsigned long long *)((stack_sample_t *)(s) + 1))
+#define SAMPLE_USTACK(s) (SAMPLE_KSTACK(s) + (s)->kstack_sz)
+#define SAMPLE_LSTACK(s) ((lua_func_t *)(SAMPLE_USTACK(s) + (s)->ustack_sz))
+#define SAMPLE_SIZE(s) (sizeof(stack_sample_t) \
+		+ ((s)->kstack_sz + (s)->ustack_sz) * sizeof(unsigned long long) \
+		+ (s)->lstack_sz * sizeof(lua_func_t))
+// largest record packed from a proc_stack_t
+#define SAMPLE_MAX_SIZE (sizeof(stack_sample_t) \
+		+ MAX_STACK_DEEP * 2 * sizeof(unsigned long long) \
+		+ MAX_STACK_DEEP * sizeof(lua_func_t))
+// largest record sent through the ring buffer from a deep_stack_t
+#define SAMPLE_DEEP_SIZE (sizeof(stack_sample_t) \
+		+ (MAX_STACK_DEEP + MAX_UNWIND_DEEP) * sizeof(unsigned long long) \
+		+ MAX_UNWIND_DEEP * sizeof(lua_func_t))
+
 
 
 #endif
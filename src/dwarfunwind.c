@@ -698,6 +698,7 @@ static void snapshot_computed_state(VECTOR_TYPE(precomputed_unwind_t) *unwinds,
 
     unsigned long orig_ip = unwind.ip;
     unwind.ip = orig_ip + item->addr_start - item->addr_offset;
+    unwind.end = region->base + region->length + item->addr_start - item->addr_offset;
     // printf("--> base: %lx, orig ip: %lx, ip: %lx, addr_start: %lx\n", region->base, orig_ip, unwind.ip, item->addr_start);
 
     VECTOR_PUSH(precomputed_unwind_t, unwinds, unwind);
@@ -844,7 +845,7 @@ static void run_cfa(VECTOR_TYPE(precomputed_unwind_t) *unwinds,
             unsigned long offset = cursor;
             unsigned long length = parse_eh_frame_uleb(cfa, cfa_length,
                 &offset);
-            state->cfa_expression = cfa + cursor;
+            state->cfa_expression = cfa + offset;
             state->cfa_expression_length = length;
             cursor = offset + length;
             break;
@@ -857,7 +858,7 @@ static void run_cfa(VECTOR_TYPE(precomputed_unwind_t) *unwinds,
                 &offset);
 
             state->saved_registers[op1].from = REG_ATEXP;
-            state->saved_registers[op1].expression = cfa + cursor;
+            state->saved_registers[op1].expression = cfa + offset;
             state->saved_registers[op1].expression_length = length;
 
             cursor = offset + length;
@@ -911,7 +912,7 @@ static void run_cfa(VECTOR_TYPE(precomputed_unwind_t) *unwinds,
                 &offset);
 
             state->saved_registers[op1].from = REG_ISEXP;
-            state->saved_registers[op1].expression = cfa + cursor;
+            state->saved_registers[op1].expression = cfa + offset;
             state->saved_registers[op1].expression_length = length;
 
             cursor = offset + length;
@@ -1055,7 +1056,8 @@ void compute_one_region(dwarf_unwind_info_t *dinfo, dwarf_unwind_region_t *regio
         precomputed_unwind_t *unwind =
             VECTOR_GET_BACK_PTR(precomputed_unwind_t,
                 &dinfo->precomputed_unwinds);
-        unwind->length = region->base + region->length - unwind->ip;
+        // ip is biased, region is not
+        unwind->length = unwind->end > unwind->ip ? unwind->end - unwind->ip : 1;
     }
 
 }
@@ -1070,8 +1072,114 @@ void compute_offsets(dwarf_unwind_info_t *dinfo) {
             precomputed_unwind_t *unwind =
                 VECTOR_GET_BACK_PTR(precomputed_unwind_t,
                     &dinfo->precomputed_unwinds);
-            unwind->length = region->base + region->length - unwind->ip;
+            unwind->length = unwind->end > unwind->ip ? unwind->end - unwind->ip : 1;
         }
     }
 }
 
+int dwarf_state_fp_safe(const dwarf_state_t *state) {
+    // plt stubs never call, realigned frames still push rbp after the
+    // copied return address
+    if(state->cfa_expression != NULL) {
+        return 1;
+    }
+
+    // push rbp; mov rbp, rsp done: cfa = rbp + 16, rbp at cfa - 16
+    if(state->cfa_register == DWARF_RBP) {
+        return state->cfa_offset == 16
+            && state->saved_registers[DWARF_RBP].from == REG_CFA
+            && state->saved_registers[DWARF_RBP].value == -16;
+    }
+
+    if(state->cfa_register == DWARF_RSP) {
+        // function entry or after the epilogue, a call can not happen here
+        // since rsp is not 16 byte aligned
+        if(state->cfa_offset == 8) {
+            return 1;
+        }
+        // between push rbp and mov rbp, rsp
+        return state->cfa_offset == 16
+            && state->saved_registers[DWARF_RBP].from == REG_CFA
+            && state->saved_registers[DWARF_RBP].value == -16;
+    }
+
+    return 0;
+}
+
+static int parse_expr_breg(const unsigned char *expr, size_t length, size_t *cursor,
+    unsigned int *reg, long *offset) {
+
+    if(*cursor >= length) {
+        return -1;
+    }
+
+    unsigned char op = expr[*cursor];
+    if(op < DW_OP_breg0 || op > DW_OP_breg31) {
+        return -1;
+    }
+    (*cursor)++;
+
+    *reg = op - DW_OP_breg0;
+    *offset = parse_eh_frame_sleb((void *)expr, length, cursor);
+    return *reg < DWARF_REGS ? 0 : -1;
+}
+
+int dwarf_compile_cfa_expr(const unsigned char *expr, size_t length, dwarf_expr_rule_t *out) {
+    // tail of the plt pattern after DW_OP_breg7 off; DW_OP_breg16 0
+    static const unsigned char plt_tail[] = {
+        DW_OP_lit15, DW_OP_and, DW_OP_lit0 /* threshold */, DW_OP_ge,
+        DW_OP_lit3, DW_OP_shl, DW_OP_plus
+    };
+    size_t cursor = 0;
+    unsigned int rip;
+    long rip_offset;
+
+    memset(out, 0, sizeof(*out));
+    out->rule = CFA_RULE_UNKNOWN;
+    if(parse_expr_breg(expr, length, &cursor, &out->reg, &out->offset) < 0) {
+        return -1;
+    }
+
+    if(cursor == length) {
+        out->rule = CFA_RULE_REG;
+        return 0;
+    }
+
+    if(cursor + 1 == length && expr[cursor] == DW_OP_deref) {
+        out->rule = CFA_RULE_DEREF;
+        return 0;
+    }
+
+    if(parse_expr_breg(expr, length, &cursor, &rip, &rip_offset) < 0
+        || rip != DWARF_RIP || rip_offset != 0) {
+        return -1;
+    }
+
+    if(length - cursor != sizeof(plt_tail)) {
+        return -1;
+    }
+
+    for(size_t i = 0; i < sizeof(plt_tail); i++) {
+        unsigned char op = expr[cursor + i];
+        if(plt_tail[i] == DW_OP_lit0) {
+            if(op < DW_OP_lit0 || op > DW_OP_lit31) {
+                return -1;
+            }
+            out->arg = op - DW_OP_lit0;
+        }
+        else if(op != plt_tail[i]) {
+            return -1;
+        }
+    }
+
+    out->rule = CFA_RULE_PLT;
+    return 0;
+}
+
+int dwarf_compile_reg_expr(const unsigned char *expr, size_t length, unsigned int *reg, long *offset) {
+    size_t cursor = 0;
+    if(parse_expr_breg(expr, length, &cursor, reg, offset) < 0 || cursor != length) {
+        return -1;
+    }
+    return 0;
+}
@@ -25,6 +25,7 @@ struct frame_cie_t;
 typedef struct precomputed_unwind_t {
     unsigned long ip;
     unsigned long length;
+    unsigned long end; // end of the FDE the row is in, same bias as ip
 
     dwarf_state_t state;
 } precomputed_unwind_t;
@@ -65,6 +66,22 @@ void compute_one_region(dwarf_unwind_info_t *dinfo, dwarf_unwind_region_t *regio
 
 unsigned long dwarf_unwind(dwarf_unwind_info_t *dinfo, unsigned long *regs);
 
+// 1 if a call made while this state is active can be unwound by the rbp chain
+int dwarf_state_fp_safe(const dwarf_state_t *state);
+
+typedef struct dwarf_expr_rule_t {
+    int rule; // CFA_RULE_*
+    unsigned int reg;
+    long offset;
+    int arg;
+} dwarf_expr_rule_t;
+
+// match a DW_CFA_def_cfa_expression against the shapes the bpf unwinder can
+// evaluate, -1 if it is none of them
+int dwarf_compile_cfa_expr(const unsigned char *expr, size_t length, dwarf_expr_rule_t *out);
+// a DW_CFA_expression/val_expression of a single DW_OP_bregN offset
+int dwarf_compile_reg_expr(const unsigned char *expr, size_t length, unsigned int *reg, long *offset);
+
 
 
 #endif
@@ -118,12 +118,19 @@ static void free_item(running_maps_t *maps) {
     maps->item = NULL;
 }
 
+void proc_root_path(int pid, const char *path, char *buf, size_t sz) {
+    snprintf(buf, sz, "/proc/%d/root%s", pid, path);
+}
+
 running_maps_t *create_maps(int pid) {
     FILE *f;
     char line[ITEM_MAX_LEN];
+    char root_path[ROOT_PATH_MAX];
 
     char r, w, x, p;
-    int dev_major, dev_minor, inode, item_count;
+    unsigned int dev_major, dev_minor;
+    unsigned long inode;
+    int item_count;
     running_maps_t *maps = malloc(sizeof(*maps));
 
     if (maps == NULL) {
@@ -151,7 +158,7 @@ running_maps_t *create_maps(int pid) {
         }
 
         map_item_t *item = &maps->item[item_count];
-        int scan = sscanf(line, "%zx-%zx %c%c%c%c %zx %x:%x %d %[^\t\n]",
+        int scan = sscanf(line, "%zx-%zx %c%c%c%c %zx %x:%x %lu %[^\t\n]",
                 &item->addr_start, &item->addr_end,
                 &r, &w, &x, &p,
                 &item->addr_offset,
@@ -163,7 +170,16 @@ running_maps_t *create_maps(int pid) {
             continue;
         }
 
-        parse_elf(&item->elf, item->path);
+        // deleted or unreachable files, e.g. "/usr/lib/foo.so (deleted)"
+        proc_root_path(pid, item->path, root_path, sizeof(root_path));
+        if (access(root_path, R_OK) != 0) {
+            LOG(WARN, "skip %s: %s", root_path, strerror(errno));
+            continue;
+        }
+
+        item->dev = ((unsigned long)dev_major << 20) | dev_minor;
+        item->inode = inode;
+        parse_elf(&item->elf, root_path);
 
         item_count ++;
         if (item_count >= maps->count) {
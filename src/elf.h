@@ -1,9 +1,11 @@
 #ifndef ELF_H
 #define ELF_H
 
+#include <stddef.h>
 #include <linux/elf.h>
 
-#define PATH_MAX 128
+#define MAP_PATH_MAX 128
+#define ROOT_PATH_MAX (MAP_PATH_MAX + 32)
 
 typedef struct elf_t {
     unsigned char *map;
@@ -22,7 +24,9 @@ typedef struct map_item_t {
     unsigned long addr_start;
     unsigned long addr_end;
     unsigned long addr_offset;
-    char path[PATH_MAX];
+    unsigned long dev; // major << 20 | minor, as the kernel encodes it
+    unsigned long inode;
+    char path[MAP_PATH_MAX];
     elf_t elf;
 } map_item_t;
 
@@ -37,6 +41,9 @@ void parse_elf(elf_t *elf, const char *filename);
 void close_elf_map(elf_t *elf);
 Elf64_Shdr *find_section_header_by_name(elf_t *elf, const char *name);
 const Elf64_Sym *find_symname_address(elf_t *elf, const char* symname);
+// path of a file mapped by pid as seen from here, through the root of pid so
+// files of a process in another mount namespace open too
+void proc_root_path(int pid, const char *path, char *buf, size_t sz);
 running_maps_t *create_maps(int pid);
 void free_maps(running_maps_t *maps);
 
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <bpf/bpf.h>
 
 #include "common.h"
 #include "fgraph.h"
@@ -22,6 +23,16 @@
 static FILE *f = NULL;
 struct syms_cache *syms_cache = NULL;
 
+// chunk names interned by the bpf side, indexed by lua_func_t.source
+static VECTOR_TYPE(lua_source_t) sources;
+
+
+static const char *lua_source_name(unsigned int source) {
+	if (source == 0 || source >= VECTOR_GET_SIZE(lua_source_t, &sources)) {
+		return UNKNOW;
+	}
+	return VECTOR_GET_PTR(lua_source_t, &sources, source)->name;
+}
 
 static int is_luaV_execute(const char *symname) {
 	#define execute "luaV_execute"
@@ -33,7 +44,8 @@ static int is_luaD_precall(const char *symname) {
 	return !strcmp(precall, symname);
 }
 
-static int show_lua_next_stack(proc_stack_t *stk, const char *symname, int ustack_idx, int *next_idx, char *data) {
+static int show_lua_next_stack(stack_sample_t *stk, const char *symname, int ustack_idx, int *next_idx, char *data) {
+	lua_func_t *lstack = SAMPLE_LSTACK(stk);
 	if (*next_idx >= stk->lstack_sz) {
 		return 0;
 	}
@@ -47,20 +59,20 @@ static int show_lua_next_stack(proc_stack_t *stk, const char *symname, int ustac
 	int sz = 0;
 
 	for (int j = start_idx+1; j < stk->lstack_sz; j++) {
-		lua_func_t *tmp = &stk->lstack[j];
-		if (tmp->lv_idx == ustack_idx && stk->lstack[start_idx].lv_idx != ustack_idx) {
+		lua_func_t *tmp = &lstack[j];
+		if (tmp->lv_idx == ustack_idx && lstack[start_idx].lv_idx != ustack_idx) {
 			i = j;
 			break;
 		}
 	}
 
 	for (; i < stk->lstack_sz; i++) {
-		lua_func_t *p = &stk->lstack[i];
+		lua_func_t *p = &lstack[i];
 		if (p->flag < 0) {
 			continue;
 		}
 		sz += sprintf(data + sz, "\t%d function<..%s:%d,%d> (line:%d)\n", 
-				p->lv_idx, p->u.l.file, p->u.l.startline, p->u.l.endline, p->u.l.currline);
+				p->lv_idx, lua_source_name(p->source), p->startline, p->endline, p->currline);
 		if (p->flag & CIST_FRESH) {
 			*next_idx = i+1;
 			return sz;
@@ -71,9 +83,9 @@ static int show_lua_next_stack(proc_stack_t *stk, const char *symname, int ustac
 	return sz;
 }
 
-static int show_ustack_trace(proc_stack_t *stk, int pid, char *data, const struct syms *syms) {
+static int show_ustack_trace(stack_sample_t *stk, int pid, char *data, const struct syms *syms) {
 	int stack_sz = stk->ustack_sz;
-    unsigned long long *stack = stk->ustack;
+    unsigned long long *stack = SAMPLE_USTACK(stk);
 	int next_idx = 0;
 	int is_precall = 0;
 	int sz = 0;
@@ -107,23 +119,68 @@ static int show_ustack_trace(proc_stack_t *stk, int pid, char *data, const struc
 	return sz;
 }
 
-void fgraph_output(VECTOR_TYPE(proc_stack_t) *proclist, int pid, const char *pname) {
-	char buf[1024 * MAX_STACK_DEEP];
+// proc_name gives the name of the root frame of a pid, service_label the root
+// frame of a skynet service, "" for none and NULL to leave the sample out
+void fgraph_output(VECTOR_TYPE(char) *proclist, const char *(*proc_name)(int pid),
+		const char *(*service_label)(const stack_sample_t *s)) {
+	static char buf[1024 * MAX_UNWIND_DEEP];
 	const struct syms *syms;
-	printf("collect stack frame size: %ld\n", VECTOR_GET_SIZE(proc_stack_t, proclist));
+	size_t count = 0;
 
-	syms = syms_cache__get_syms(syms_cache, pid);
-	if (!syms) {
-		return;
-	}
+	size_t off = 0;
+	while (off < VECTOR_GET_SIZE(char, proclist)) {
+		stack_sample_t *stk = (stack_sample_t *)VECTOR_GET_PTR(char, proclist, off);
+		off += SAMPLE_SIZE(stk);
+
+		const char *service = service_label(stk);
+		if (!service) {
+			continue;
+		}
+
+		int pid = stk->pid;
+		syms = syms_cache__get_syms(syms_cache, pid);
+		if (!syms) {
+			continue;
+		}
+		count++;
 
-    VECTOR_FOR_EACH_PTR(proc_stack_t, stk, proclist) {
 		size_t sz = 0;
-		sz = sprintf(buf, "%s  %d [0]  0.0:   0 cycles: \n", pname, pid);
+		if (stk->tid) {
+			sz = sprintf(buf, "%s  %d/%u [0]  0.0: %llu cycles: \n", proc_name(pid), pid, stk->tid, stk->weight);
+		} else {
+			sz = sprintf(buf, "%s  %d [0]  0.0: %llu cycles: \n", proc_name(pid), pid, stk->weight);
+		}
         sz += show_ustack_trace(stk, pid, buf + sz, syms);
+		// wall-clock stacks are split under an on/off cpu root frame
+		if (stk->state) {
+			sz += sprintf(buf + sz, "\t%016llx %s (%s)\n", 0ULL,
+				stk->state == STACK_STATE_ONCPU ? "[on-cpu]" : "[off-cpu]", UNKNOW);
+		}
+		// services sharing the worker threads are split under their own root
+		if (service[0]) {
+			sz += sprintf(buf + sz, "\t%016llx [service %s] (%s)\n", 0ULL, service, UNKNOW);
+		}
 		sz += sprintf(buf + sz, "\n");
 		fwrite(buf, 1, sz, f);
     }
+	printf("collect stack frame size: %zu\n", count);
+}
+
+// copy the id -> name table out of lua_name_map, count is the number of ids handed out
+void fgraph_load_sources(int map_fd, unsigned int count) {
+	lua_source_t src;
+	if (count >= MAX_LUA_SOURCES) {
+		count = MAX_LUA_SOURCES - 1;
+	}
+
+	VECTOR_RESIZE(lua_source_t, &sources, count + 1);
+	for (unsigned int id = 0; id <= count; id++) {
+		if (bpf_map_lookup_elem(map_fd, &id, &src) < 0) {
+			src.name[0] = '\0';
+		}
+		src.name[sizeof(src.name) - 1] = '\0';
+		*VECTOR_GET_PTR(lua_source_t, &sources, id) = src;
+	}
 }
 
 int fgraph_init(const char *fname) {
@@ -133,6 +190,8 @@ int fgraph_init(const char *fname) {
 		return -1;
 	}
 
+	VECTOR_INIT(lua_source_t, &sources);
+
 	syms_cache = syms_cache__new(0);
 	if (!syms_cache) {
 		printf("new syms_cache failed\n");
@@ -147,4 +206,5 @@ void fgraph_free() {
 		fclose(f);
 	}
 	syms_cache__free(syms_cache);
+	VECTOR_FREE(lua_source_t, &sources);
 }
@@ -3,10 +3,13 @@
 
 
 #include "vector.h"
+#include "common.h"
 
 
 int fgraph_init(const char *fname);
 void fgraph_free();
-void fgraph_output(VECTOR_TYPE(proc_stack_t) *proclist, int pid, const char *pname);
+void fgraph_load_sources(int map_fd, unsigned int count);
+void fgraph_output(VECTOR_TYPE(char) *proclist, const char *(*proc_name)(int pid),
+		const char *(*service_label)(const stack_sample_t *s));
 
 #endif
@@ -19,10 +19,11 @@ typedef struct lthread_t {
 
 
 typedef struct lua_ctx_t {
-	lthread_t lbuf[MAX_STACK_DEEP]; // lua thread number
+	lthread_t lbuf[MAX_UNWIND_DEEP]; // lua thread number
 	lua_State L, *Lp;
-	Closure closure;
 	Proto proto;
+	Proto *p; // address of proto in the target
+	u32 source; // interned chunk name of proto
 
 #if (defined LUA54 || defined LUASKY)
 	StkIdRel func;	/* function index in the stack */
@@ -32,17 +33,69 @@ typedef struct lua_ctx_t {
 	CallInfo ci, *cip;
 	u32 lthread_idx;
 	int lcount;
+	u32 pid; // tgid of the target, forked processes share addresses
+	lua_source_t name; // chunk name being interned
 } lua_ctx_t;
 
 
 
 struct {
-  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
 	__uint(max_entries, 1);
   __type(key, u32);
   __type(value, lua_ctx_t);
 } lua_ctx_map SEC(".maps");
 
+// an address in a profiled process
+typedef struct lua_addr_key_t {
+	u32 pid;
+	u32 reserved;
+	u64 addr;
+} lua_addr_key_t;
+
+// the Proto fields a frame needs, they never change once the function is
+// loaded. code is checked on every hit since the address may be reused
+typedef struct lua_proto_t {
+	int linedefined;
+	int lastlinedefined;
+	u32 source;
+	Instruction *code;
+} lua_proto_t;
+
+// {pid, Proto *} -> immutable Proto fields, so a hot function costs one lookup
+// instead of reading the whole Proto from user memory on every sample
+struct {
+  __uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 16384);
+  __type(key, lua_addr_key_t);
+  __type(value, lua_proto_t);
+} lua_proto_map SEC(".maps");
+
+// an interned chunk name, hash and len tell a TString at a reused address apart
+typedef struct lua_source_id_t {
+	u32 id;
+	u32 hash;
+	u64 len;
+} lua_source_id_t;
+
+// {pid, chunk name TString *} -> id, the name is copied only the first time it is seen
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_LUA_SOURCES);
+  __type(key, lua_addr_key_t);
+  __type(value, lua_source_id_t);
+} lua_source_map SEC(".maps");
+
+// id -> chunk name, read by userspace when writing the flame graph
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, MAX_LUA_SOURCES);
+  __type(key, u32);
+  __type(value, lua_source_t);
+} lua_name_map SEC(".maps");
+
+u32 lua_source_count = 0;
+
 
 
 static __always_inline lua_ctx_t *init_lua_ctx_map() {
@@ -53,6 +106,7 @@ static __always_inline lua_ctx_t *init_lua_ctx_map() {
 	lctx->lcount = 0;
 	lctx->lthread_idx = 0;
 	lctx->Lp = NULL;
+	lctx->pid = bpf_get_current_pid_tgid() >> 32;
 
 	return lctx;
 }
@@ -78,130 +132,64 @@ static __always_inline int currentpc(CallInfo *ci, Proto *p) {
 	return pc;
 }
 
-#if (defined LUA54 || defined LUASKY)
-
-typedef struct baseline_t {
-	int i;
-	int pc;
-	const Proto *p;
-} baseline_t;
 
-static int loop_baseline(int idx, void *ud) {
-	baseline_t *bl = (baseline_t *)ud;
-	int i = bl->i;
-
-	if (i >= bl->p->sizeabslineinfo) {
-		return LOOP_BREAK;
+// return the id of chunk name ts, 0 when it can not be interned. the name is
+// read before an id is taken, so an unreadable name does not use one up
+static __always_inline u32 intern_lua_source(lua_ctx_t *ctx, TString *ts) {
+	lua_addr_key_t key = {
+		.pid = ctx->pid,
+		.addr = (u64)ts,
+	};
+	TString tmp;
+	read_user_data_ret(tmp, ts, 0);
+
+	lua_source_id_t item = {
+		.hash = tmp.hash,
+		.len = tsslen(&tmp),
+	};
+	lua_source_id_t *known = bpf_map_lookup_elem(&lua_source_map, &key);
+	if (known && known->hash == item.hash && known->len == item.len) {
+		return known->id;
 	}
-
-	AbsLineInfo lineinfo;
-	read_user_data_ret(lineinfo, bl->p->abslineinfo + i + 1, LOOP_BREAK);
-
-	if (bl->pc < lineinfo.pc) {
-		return LOOP_BREAK;
+	// every id is taken, do not read names that can not be kept
+	if (lua_source_count >= MAX_LUA_SOURCES) {
+		return 0;
 	}
 
-	bl->i++;
-	return LOOP_CONTINUE;
-}
-
-static int getbaseline(const Proto *f, int pc, int *basepc) {
-	if (f->sizeabslineinfo == 0) {
-		*basepc = -1;  /* start from the beginning */
-		return f->linedefined;
+	size_t sz = item.len;
+	if (sz >= sizeof(ctx->name.name)) {
+		sz = sizeof(ctx->name.name) - 1;
 	}
-	else {
-		AbsLineInfo lineinfo;
-		read_user_data_ret(lineinfo, f->abslineinfo, 0);
-		if (pc < lineinfo.pc) {
-			*basepc = -1;  /* start from the beginning */
-			return f->linedefined;
-		}
-
-		int i = cast_uint(pc) / MAXIWTHABS - 1;  /* get an estimate */
-		baseline_t bl;
-		bl.i = i;
-		bl.p = f;
-		bl.pc = pc;
-
-		bpf_loop(f->sizeabslineinfo, loop_baseline, &bl, 0);
-
-		// while (i + 1 < f->sizeabslineinfo && pc >= f->abslineinfo[i + 1].pc)
-		// 	i++;  /* low estimate; adjust it */
-
-		i = bl.i;
-
-		// *basepc = f->abslineinfo[i].pc;
-		read_user_data_ret(lineinfo, f->abslineinfo+i, 0);
-
-		*basepc = lineinfo.pc;
-		return lineinfo.line;
+	if (bpf_probe_read_user(ctx->name.name, sz, getstr(ts)) < 0) {
+		return 0;
 	}
-}
-
-typedef struct funcline_t {
-	int basepc;
-	const Proto *p;
-	int pc;
-	int baseline;
-} funcline_t;
+	ctx->name.name[sz] = '\0';
 
-
-static int loop_funcline(int idx, void *ud) {
-	funcline_t *fl = (funcline_t *)ud;
-	if (fl->basepc++ >= fl->pc) {
-		return LOOP_BREAK;
+	u32 id = __sync_fetch_and_add(&lua_source_count, 1) + 1;
+	if (id >= MAX_LUA_SOURCES) {
+		return 0;
 	}
 
-	ls_byte line;
-	read_user_data_ret(line, fl->p->lineinfo + fl->basepc, LOOP_BREAK);
-	fl->baseline += line;
-	return LOOP_CONTINUE;
-}
-
-static int luaG_getfuncline(const Proto *f, int pc) {
-	if (f == NULL || f->lineinfo == NULL)  /* no debug information? */
-		return -1;
-	else {
-		if (pc == 0) {
-			pc = 1;
-		}
-		
-		int basepc = 0;
-		int baseline = getbaseline(f, pc, &basepc);
-		// while (basepc++ < pc) {  /* walk until given instruction */
-		// 	lua_assert(f->lineinfo[basepc] != ABSLINEINFO);
-		// 	baseline += f->lineinfo[basepc];  /* correct line */
-		// }
-		funcline_t fl;
-		fl.basepc = basepc;
-		fl.baseline = baseline;
-		fl.pc = pc;
-		fl.p = f;
-
-		bpf_loop(pc, loop_funcline, &fl, 0);
-		return fl.baseline;
+	lua_source_t *src = bpf_map_lookup_elem(&lua_name_map, &id);
+	if (!src) {
+		return 0;
 	}
-}
+	__builtin_memcpy(src, &ctx->name, sizeof(*src));
 
-#endif
-
-static __always_inline int currentline(CallInfo *ci, Proto *p) {
-#if (defined LUA54 || defined LUASKY)
-	return luaG_getfuncline(p, currentpc(ci, p));
-#else
-	int pc = currentpc(ci, p);
-	int fline;
-	if (p->lineinfo && pc < p->sizelineinfo) {
-		read_user_data(fline, p->lineinfo + pc);
-		return fline;
-	}
-	return -1;
-#endif
+	// the name is in place before the id is published, a stale entry of a
+	// collected string is replaced
+	item.id = id;
+	bpf_map_update_elem(&lua_source_map, &key, &item, BPF_ANY);
+	return id;
 }
 
 
+
+// fill ctx->proto and ctx->source for the function running in ctx->ci, the
+// immutable Proto fields come from lua_proto_map when the Proto was seen before
 static __always_inline int read_lua_proto(lua_ctx_t *ctx) {
+	Proto *p;
+	GCObject *gc;
 #if (defined LUA54 || defined LUASKY)
 	void *ptr = (u8 *)ctx->ci.func.p;
 	StackValue stk;
@@ -209,36 +197,48 @@ static __always_inline int read_lua_proto(lua_ctx_t *ctx) {
 		ptr += (uintptr_t)ctx->L.stack.p;
 	}
 	read_user_data(stk, (void *)ptr);
-	read_user_data(ctx->closure, stk.val.value_.gc);
-	read_user_data(ctx->proto, ctx->closure.l.p);
+	gc = stk.val.value_.gc;
 #else
 	read_user_data(ctx->func, ctx->ci.func);
-	read_user_data(ctx->closure, ctx->func.value_.gc);
-	read_user_data(ctx->proto, ctx->closure.l.p);
+	gc = ctx->func.value_.gc;
 #endif
-
-	return 0;
-}
-
-static __always_inline int read_lua_file(lua_func_t *lfunc, TString *ts) {
-	TString tmp;
-	read_user_data(tmp, ts);
-
-	size_t sz = tsslen(&tmp);
-	size_t maxsz = sizeof(lfunc->u.l.file);
-	if (sz > maxsz) {
-		sz = maxsz;
-	}
-
-	if (!bpf_probe_read_user(lfunc->u.l.file, sz, getstr(ts))) {
-		if (sz < maxsz) {
-			lfunc->u.l.file[sz] = '\0';
-		}
-
+	read_user_data(p, &((Closure *)gc)->l.p);
+	ctx->p = p;
+
+	lua_addr_key_t key = {
+		.pid = ctx->pid,
+		.addr = (u64)p,
+	};
+	// a collected Proto leaves its address to the next one, the code array
+	// tells them apart for one 8 byte read
+	Instruction *code;
+	lua_proto_t *lp = bpf_map_lookup_elem(&lua_proto_map, &key);
+	if (lp && bpf_probe_read_user(&code, sizeof(code), &p->code) == 0 && code == lp->code) {
+		ctx->proto.linedefined = lp->linedefined;
+		ctx->proto.lastlinedefined = lp->lastlinedefined;
+		ctx->proto.code = lp->code;
+		ctx->source = lp->source;
 		return 0;
 	}
 
-	return -1;
+	read_user_data(ctx->proto, p);
+	if (!ctx->proto.source) {
+		return -1;
+	}
+	ctx->source = intern_lua_source(ctx, ctx->proto.source);
+
+	lua_proto_t tmp = {
+		.linedefined = ctx->proto.linedefined,
+		.lastlinedefined = ctx->proto.lastlinedefined,
+		.source = ctx->source,
+		.code = ctx->proto.code,
+	};
+	// a source that could not be interned is retried next time, unless there
+	// is no id left for it
+	if (tmp.source || lua_source_count >= MAX_LUA_SOURCES) {
+		bpf_map_update_elem(&lua_proto_map, &key, &tmp, BPF_ANY);
+	}
+	return 0;
 }
 
 
@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "lualine.h"
+#include "targetmem.h"
+#include "vector.h"
+
+
+#if (defined LUA54 || defined LUASKY)
+#include "luaref54.h"
+#else
+#include "luaref53.h"
+#endif
+
+
+// line table of a Proto copied out of the target
+typedef struct proto_lines_t {
+	int pid;
+	unsigned long long proto;
+	int linedefined;
+	int lastlinedefined;
+	int sizelineinfo;
+#if (defined LUA54 || defined LUASKY)
+	int sizeabslineinfo;
+	ls_byte *lineinfo;
+	AbsLineInfo *abslineinfo;
+#else
+	int *lineinfo;
+#endif
+} proto_lines_t;
+
+// sorted by (pid, proto)
+static VECTOR_TYPE(proto_lines_t) protos;
+
+
+// copy count elements of size sz from the target, NULL when it fails or there is nothing
+static void *read_target_array(int pid, const void *src, int count, size_t sz) {
+	if (src == NULL || count <= 0) {
+		return NULL;
+	}
+
+	void *dst = malloc(count * sz);
+	if (dst && read_target(pid, dst, src, count * sz) < 0) {
+		free(dst);
+		dst = NULL;
+	}
+	return dst;
+}
+
+static int load_proto_lines(proto_lines_t *pl) {
+	Proto p;
+	if (read_target(pl->pid, &p, (void *)pl->proto, sizeof(p)) < 0) {
+		return -1;
+	}
+
+	pl->linedefined = p.linedefined;
+	pl->lastlinedefined = p.lastlinedefined;
+	pl->lineinfo = read_target_array(pl->pid, p.lineinfo, p.sizelineinfo, sizeof(*p.lineinfo));
+	pl->sizelineinfo = pl->lineinfo ? p.sizelineinfo : 0;
+#if (defined LUA54 || defined LUASKY)
+	pl->abslineinfo = read_target_array(pl->pid, p.abslineinfo, p.sizeabslineinfo, sizeof(*p.abslineinfo));
+	pl->sizeabslineinfo = pl->abslineinfo ? p.sizeabslineinfo : 0;
+#endif
+	return 0;
+}
+
+#if (defined LUA54 || defined LUASKY)
+
+// same as ldebug.c getbaseline/luaG_getfuncline on the copied tables
+static int getbaseline(const proto_lines_t *f, int pc, int *basepc) {
+	if (f->sizeabslineinfo == 0 || pc < f->abslineinfo[0].pc) {
+		*basepc = -1;  /* start from the beginning */
+		return f->linedefined;
+	}
+
+	int i = pc / MAXIWTHABS - 1;  /* get an estimate */
+	if (i < 0) {
+		i = 0;
+	} else if (i >= f->sizeabslineinfo) {
+		i = f->sizeabslineinfo - 1;
+	}
+	while (i > 0 && f->abslineinfo[i].pc > pc) {
+		i--;
+	}
+	while (i + 1 < f->sizeabslineinfo && pc >= f->abslineinfo[i + 1].pc) {
+		i++;  /* low estimate; adjust it */
+	}
+	*basepc = f->abslineinfo[i].pc;
+	return f->abslineinfo[i].line;
+}
+
+static int getfuncline(const proto_lines_t *f, int pc) {
+	if (f->lineinfo == NULL || pc >= f->sizelineinfo) {  /* no debug information? */
+		return -1;
+	}
+
+	int basepc;
+	int baseline = getbaseline(f, pc, &basepc);
+	while (basepc++ < pc) {  /* walk until given instruction */
+		baseline += f->lineinfo[basepc];  /* correct line */
+	}
+	return baseline;
+}
+
+#else
+
+static int getfuncline(const proto_lines_t *f, int pc) {
+	if (f->lineinfo == NULL || pc >= f->sizelineinfo) {
+		return -1;
+	}
+	return f->lineinfo[pc];
+}
+
+#endif
+
+static int cmp_proto(const proto_lines_t *a, int pid, unsigned long long proto) {
+	if (a->pid != pid) {
+		return a->pid < pid ? -1 : 1;
+	}
+	if (a->proto != proto) {
+		return a->proto < proto ? -1 : 1;
+	}
+	return 0;
+}
+
+static void free_proto_lines(proto_lines_t *pl) {
+	free(pl->lineinfo);
+#if (defined LUA54 || defined LUASKY)
+	free(pl->abslineinfo);
+#endif
+}
+
+int lualine_resolve(int pid, unsigned long long proto, int linedefined, int lastlinedefined, int pc) {
+	if (proto == 0 || pc < 0) {
+		return -1;
+	}
+
+	size_t sz = VECTOR_GET_SIZE(proto_lines_t, &protos);
+	size_t lo = 0, hi = sz;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (cmp_proto(VECTOR_GET_PTR(proto_lines_t, &protos, mid), pid, proto) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (lo < sz && !cmp_proto(VECTOR_GET_PTR(proto_lines_t, &protos, lo), pid, proto)) {
+		proto_lines_t *pl = VECTOR_GET_PTR(proto_lines_t, &protos, lo);
+		if (pl->linedefined == linedefined && pl->lastlinedefined == lastlinedefined) {
+			return getfuncline(pl, pc);
+		}
+
+		// the Proto was collected and another one took its address
+		proto_lines_t item;
+		memset(&item, 0, sizeof(item));
+		item.pid = pid;
+		item.proto = proto;
+		if (load_proto_lines(&item) < 0) {
+			return -1;
+		}
+		free_proto_lines(pl);
+		*pl = item;
+		return getfuncline(pl, pc);
+	}
+
+	proto_lines_t item;
+	memset(&item, 0, sizeof(item));
+	item.pid = pid;
+	item.proto = proto;
+	if (load_proto_lines(&item) < 0) {
+		// the process is gone or the Proto was collected, try again next time
+		return -1;
+	}
+
+	VECTOR_PUSH(proto_lines_t, &protos, item);
+	proto_lines_t *data = VECTOR_DATA(proto_lines_t, &protos);
+	memmove(data + lo + 1, data + lo, (sz - lo) * sizeof(proto_lines_t));
+	data[lo] = item;
+	return getfuncline(&data[lo], pc);
+}
+
+void lualine_init() {
+	VECTOR_INIT(proto_lines_t, &protos);
+}
+
+void lualine_free() {
+	VECTOR_FOR_EACH_PTR(proto_lines_t, p, &protos) {
+		free_proto_lines(p);
+	}
+	VECTOR_FREE(proto_lines_t, &protos);
+}
@@ -0,0 +1,12 @@
+#ifndef LUALINE_H
+#define LUALINE_H
+
+
+// resolve the source line of instruction pc in a Proto of process pid, the line
+// table is read out of the target once per Proto and cached. linedefined and
+// lastlinedefined of the sample tell a reused Proto address from the cached one
+int lualine_resolve(int pid, unsigned long long proto, int linedefined, int lastlinedefined, int pc);
+void lualine_init();
+void lualine_free();
+
+#endif
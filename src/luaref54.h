@@ -152,6 +152,28 @@ typedef struct stringtable {
 	int size;
 } stringtable;
 
+typedef union Node {
+	struct NodeKey {
+		TValuefields;	/* fields for value */
+		lu_byte key_tt;	/* key type */
+		int next;	/* for chaining */
+		Value key_val;	/* key value */
+	} u;
+	TValue i_val;	/* direct access to node's value as a proper 'TValue' */
+} Node;
+
+typedef struct Table {
+	CommonHeader;
+	lu_byte flags;	/* 1<<p means tagmethod(p) is not present */
+	lu_byte lsizenode;	/* log2 of size of 'node' array */
+	unsigned int alimit;	/* "limit" of 'array' array */
+	TValue *array;	/* array part */
+	Node *node;
+	Node *lastfree;	/* any free position is before this position */
+	struct Table *metatable;
+	GCObject *gclist;
+} Table;
+
 typedef union StackValue {
 	TValue val;
 	struct {
@@ -386,6 +408,9 @@ union GCUnion {
 #define ci_func(ci)		(clLvalue(s2v((ci)->func.p)))
 #define getstr(ts)		((ts)->contents) 
 #define LUA_VSHRSTR	 makevariant(LUA_TSTRING, 0)	
+#define LUA_VLNGSTR	 makevariant(LUA_TSTRING, 1)
+#define LUA_VTABLE	makevariant(LUA_TTABLE, 0)
+#define LUA_RIDX_GLOBALS	2
 #define tsslen(s)		 ((s)->tt == LUA_VSHRSTR ? (s)->shrlen : (s)->u.lnglen)		 
 #define ctb(t)				((t) | BIT_ISCOLLECTABLE)			
 #define rawtt(o)				((o)->tt_)		 
@@ -404,6 +429,49 @@ union GCUnion {
 
 #define ABSLINEINFO	(-0x80)
 
+#ifdef LUASKY
+/*
+** leading fields of skynet_server.c struct skynet_context
+*/
+struct skynet_context {
+	void * instance;
+	struct skynet_module * mod;
+	void * cb_ud;
+	void * cb;
+	struct message_queue *queue;
+	void * logfile;
+	uint64_t cpu_cost;	// in microsec
+	uint64_t cpu_start;	// in microsec
+	char result[32];
+	uint32_t handle;
+	int session_id;
+};
+
+struct skynet_module {
+	const char * name;
+	void * module;
+};
+
+/*
+** skynet_handle.c, the table of every service, the static H points to it
+*/
+struct handle_storage {
+	int lock[2];	// struct rwlock without USE_PTHREAD_LOCK
+	uint32_t harbor;
+	uint32_t handle_index;
+	int slot_size;
+	struct skynet_context ** slot;
+};
+
+/*
+** service_snlua.c, the instance of a lua service
+*/
+struct snlua {
+	lua_State * L;
+	struct skynet_context * ctx;
+};
+#endif
+
 
 #endif
 
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "luasnap.h"
+#include "lualine.h"
+#include "targetmem.h"
+#include "common.h"
+#include "logger.h"
+
+
+#if (defined LUA54 || defined LUASKY)
+#include "luaref54.h"
+#else
+#include "luaref53.h"
+#endif
+
+#define LUA_OK 0
+#define LUA_YIELD 1
+
+// the object list is walked while the target runs, a list broken by a sweep
+// ends here at the latest
+#define SNAP_MAX_OBJECTS (1 << 26)
+#define SNAP_FRAME_SIZE (STR_BUFFER_SIZE + 64)
+
+
+static unsigned long long hash_text(const char *s) {
+	unsigned long long h = 14695981039346656037ULL;
+	for (; *s; s++) {
+		h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+	}
+	return h;
+}
+
+// one line for the function running in ci, same format as the flame graph
+static int show_frame(int pid, const CallInfo *ci, char *data, size_t sz) {
+#if (defined LUA54 || defined LUASKY)
+	const TValue *fv = s2v(ci->func.p);
+#else
+	const TValue *fv = ci->func;
+#endif
+	TValue func;
+	if (read_target(pid, &func, fv, sizeof(func)) < 0) {
+		return snprintf(data, sz, "\t?\n");
+	}
+	if (!isLua(ci) || !ttisLclosure(&func)) {
+		return snprintf(data, sz, "\t[C]\n");
+	}
+
+	LClosure cl;
+	Proto p;
+	if (read_target(pid, &cl, val_(&func).gc, sizeof(cl)) < 0
+			|| read_target(pid, &p, cl.p, sizeof(p)) < 0) {
+		return snprintf(data, sz, "\t?\n");
+	}
+
+	char source[STR_BUFFER_SIZE];
+	read_target_tstring(pid, p.source, source, sizeof(source));
+	int pc = (int)(ci->u.l.savedpc - p.code) - 1;
+	int line = lualine_resolve(pid, (unsigned long long)cl.p, p.linedefined, p.lastlinedefined, pc);
+	return snprintf(data, sz, "\tfunction<..%s:%d,%d> (line:%d)\n",
+			source, p.linedefined, p.lastlinedefined, line);
+}
+
+static void add_stack(luasnap_t *snap, const char *text) {
+	unsigned long long hash = hash_text(text);
+	VECTOR_FOR_EACH_PTR(luasnap_stack_t, s, &snap->stacks) {
+		if (s->hash == hash && strcmp(s->text, text) == 0) {
+			s->count++;
+			return;
+		}
+	}
+
+	luasnap_stack_t item = {
+		.hash = hash,
+		.count = 1,
+		.text = strdup(text),
+	};
+	if (item.text) {
+		VECTOR_PUSH(luasnap_stack_t, &snap->stacks, item);
+	}
+}
+
+// the CallInfo chain of thread L, from L->ci down to its base_ci
+static int add_thread(luasnap_t *snap, lua_State *L) {
+	static char text[MAX_UNWIND_DEEP * SNAP_FRAME_SIZE + 64];
+	lua_State th;
+	if (read_target(snap->pid, &th, L, sizeof(th)) < 0) {
+		return -1;
+	}
+
+	CallInfo *base = (CallInfo *)((char *)L + offsetof(lua_State, base_ci));
+	const char *status = "running";
+	if (th.status == LUA_YIELD) {
+		status = "suspended";
+	} else if (th.status != LUA_OK) {
+		status = "dead with error";
+	} else if (th.ci == base) {
+		status = "no frames";
+	}
+
+	size_t sz = snprintf(text, sizeof(text), "[%s]\n", status);
+	CallInfo *cip = th.ci;
+	int depth = 0;
+	for (; cip && cip != base && depth < MAX_UNWIND_DEEP; depth++) {
+		CallInfo ci;
+		if (read_target(snap->pid, &ci, cip, sizeof(ci)) < 0) {
+			sz += snprintf(text + sz, sizeof(text) - sz, "\t?\n");
+			break;
+		}
+		sz += show_frame(snap->pid, &ci, text + sz, sizeof(text) - sz);
+		cip = ci.previous;
+	}
+	if (depth == MAX_UNWIND_DEEP) {
+		snprintf(text + sz, sizeof(text) - sz, "\t...\n");
+	}
+
+	add_stack(snap, text);
+	return 0;
+}
+
+void luasnap_init(luasnap_t *snap, int pid) {
+	memset(snap, 0, sizeof(*snap));
+	snap->pid = pid;
+	VECTOR_INIT(luasnap_stack_t, &snap->stacks);
+}
+
+void luasnap_free(luasnap_t *snap) {
+	VECTOR_FOR_EACH_PTR(luasnap_stack_t, s, &snap->stacks) {
+		free(s->text);
+	}
+	VECTOR_FREE(luasnap_stack_t, &snap->stacks);
+}
+
+int luasnap_walk(luasnap_t *snap, unsigned long long g) {
+	global_State gs;
+	if (read_target(snap->pid, &gs, (void *)g, sizeof(gs)) < 0) {
+		return -1;
+	}
+	snap->states++;
+
+	// the main thread is not in allgc
+	int count = add_thread(snap, gs.mainthread) == 0;
+	GCObject *o = gs.allgc;
+	int i = 0;
+	for (; o && i < SNAP_MAX_OBJECTS; i++) {
+		GCObject hdr;
+		if (read_target(snap->pid, &hdr, o, sizeof(hdr)) < 0) {
+			LOG(WARN, "pid %d global_State 0x%llx: object list broken after %d objects",
+				snap->pid, g, i);
+			break;
+		}
+		if ((hdr.tt & 0x0F) == LUA_TTHREAD && add_thread(snap, (lua_State *)o) == 0) {
+			count++;
+		}
+		o = hdr.next;
+	}
+	if (i == SNAP_MAX_OBJECTS) {
+		LOG(WARN, "pid %d global_State 0x%llx: more than %d objects, the rest is skipped",
+			snap->pid, g, SNAP_MAX_OBJECTS);
+	}
+
+	snap->threads += count;
+	return count;
+}
+
+static int cmp_count(const void *a, const void *b) {
+	const luasnap_stack_t *x = a, *y = b;
+	return y->count - x->count;
+}
+
+void luasnap_print(luasnap_t *snap, const char *comm) {
+	size_t n = VECTOR_GET_SIZE(luasnap_stack_t, &snap->stacks);
+	qsort(VECTOR_DATA(luasnap_stack_t, &snap->stacks), n, sizeof(luasnap_stack_t), cmp_count);
+
+	printf("\npid %d %s: %d lua states, %d threads, %zu distinct stacks\n",
+		snap->pid, comm, snap->states, snap->threads, n);
+	VECTOR_FOR_EACH_PTR(luasnap_stack_t, s, &snap->stacks) {
+		printf("\n%6d %s", s->count, s->text);
+	}
+}
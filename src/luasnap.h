@@ -0,0 +1,30 @@
+#ifndef LUASNAP_H
+#define LUASNAP_H
+
+#include "vector.h"
+
+
+// coroutines of one process with the same status and CallInfo chain
+typedef struct luasnap_stack_t {
+	unsigned long long hash;
+	int count;
+	char *text; // one frame per line, innermost first
+} luasnap_stack_t;
+
+typedef struct luasnap_t {
+	int pid;
+	int states; // global_States walked
+	int threads; // lua_States found in them
+	VECTOR_TYPE(luasnap_stack_t) stacks;
+} luasnap_t;
+
+
+void luasnap_init(luasnap_t *snap, int pid);
+void luasnap_free(luasnap_t *snap);
+// walk the objects of global_State g in the target and add every thread to
+// snap, returns the number of threads or -1 when g can not be read
+int luasnap_walk(luasnap_t *snap, unsigned long long g);
+// the stacks, most common first
+void luasnap_print(luasnap_t *snap, const char *comm);
+
+#endif
@@ -14,6 +14,15 @@ typedef enum register_source {
     REG_CONSTANT
 } register_source;
 
+// how the bpf unwinder gets the cfa, userspace compiles the common
+// DW_CFA_def_cfa_expression shapes into one of these
+typedef enum cfa_rule {
+    CFA_RULE_REG = 0,   // cfa = reg + offset
+    CFA_RULE_PLT,       // cfa = reg + offset + (((rip & 15) >= arg) << 3), plt stubs
+    CFA_RULE_DEREF,     // cfa = *(reg + offset), realigned stack frames
+    CFA_RULE_UNKNOWN
+} cfa_rule;
+
 typedef enum register_index {
     DWARF_RAX,
     DWARF_RDX,
@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "skynet.h"
+#include "vector.h"
+#include "elf.h"
+#include "targetmem.h"
+
+
+#ifdef LUASKY
+
+#include "luaref54.h"
+
+#define SERVICE_NAME_LEN 64
+// a table bigger than this is not the globals of a service
+#define MAX_GLOBALS_NODES (1 << 16)
+// skynet handles have 24 bits
+#define MAX_SLOT_SIZE (1 << 24)
+
+typedef struct service_t {
+	int pid;
+	unsigned int handle;
+	int found;
+	char name[SERVICE_NAME_LEN];
+} service_t;
+
+// sorted by (pid, handle)
+static VECTOR_TYPE(service_t) services;
+
+
+static int read_cstr(int pid, const char *src, char *buf, size_t sz) {
+	if (src == NULL || read_target(pid, buf, src, sz - 1) < 0) {
+		return -1;
+	}
+	buf[sz - 1] = '\0';
+	return 0;
+}
+
+// string value of key name in the globals of L, loader.lua sets SERVICE_NAME
+static int read_global(int pid, lua_State *L, const char *name, char *buf, size_t sz) {
+	lua_State th;
+	global_State g;
+	Table reg, gt;
+	TValue v;
+	if (read_target(pid, &th, L, sizeof(th)) < 0
+			|| read_target(pid, &g, th.l_G, sizeof(g)) < 0
+			|| !checktag(&g.l_registry, ctb(LUA_VTABLE))
+			|| read_target(pid, &reg, val_(&g.l_registry).gc, sizeof(reg)) < 0
+			|| read_target(pid, &v, reg.array + LUA_RIDX_GLOBALS - 1, sizeof(v)) < 0
+			|| !checktag(&v, ctb(LUA_VTABLE))
+			|| read_target(pid, &gt, val_(&v).gc, sizeof(gt)) < 0) {
+		return -1;
+	}
+
+	int count = 1 << gt.lsizenode;
+	if (count > MAX_GLOBALS_NODES) {
+		return -1;
+	}
+	Node *nodes = malloc(count * sizeof(Node));
+	if (nodes == NULL || read_target(pid, nodes, gt.node, count * sizeof(Node)) < 0) {
+		free(nodes);
+		return -1;
+	}
+
+	int err = -1;
+	char key[SERVICE_NAME_LEN];
+	for (int i = 0; i < count && err < 0; i++) {
+		Node *n = &nodes[i];
+		if (n->u.key_tt != ctb(LUA_VSHRSTR)
+				|| read_target_tstring(pid, n->u.key_val.gc, key, sizeof(key)) < 0
+				|| strcmp(key, name) != 0) {
+			continue;
+		}
+		if (checktag(&n->i_val, ctb(LUA_VSHRSTR)) || checktag(&n->i_val, ctb(LUA_VLNGSTR))) {
+			err = read_target_tstring(pid, val_(&n->i_val).gc, buf, sz);
+		}
+		break;
+	}
+	free(nodes);
+	return err;
+}
+
+static int load_service(service_t *s, unsigned long long addr) {
+	struct skynet_context ctx;
+	struct skynet_module mod;
+	if (read_target(s->pid, &ctx, (void *)addr, sizeof(ctx)) < 0 || ctx.handle != s->handle
+			|| read_target(s->pid, &mod, ctx.mod, sizeof(mod)) < 0
+			|| read_cstr(s->pid, mod.name, s->name, sizeof(s->name)) < 0) {
+		return -1;
+	}
+
+	struct snlua lua;
+	char name[SERVICE_NAME_LEN];
+	if (strcmp(s->name, "snlua") == 0
+			&& read_target(s->pid, &lua, ctx.instance, sizeof(lua)) == 0
+			&& read_global(s->pid, lua.L, "SERVICE_NAME", name, sizeof(name)) == 0) {
+		strcpy(s->name, name);
+	}
+	return 0;
+}
+
+const char *skynet_service_name(int pid, unsigned int handle, unsigned long long ctx) {
+	size_t sz = VECTOR_GET_SIZE(service_t, &services);
+	size_t lo = 0, hi = sz;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		service_t *s = VECTOR_GET_PTR(service_t, &services, mid);
+		if (s->pid < pid || (s->pid == pid && s->handle < handle)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (lo < sz) {
+		service_t *s = VECTOR_GET_PTR(service_t, &services, lo);
+		if (s->pid == pid && s->handle == handle) {
+			return s->found ? s->name : NULL;
+		}
+	}
+
+	// an exited service is remembered as not found too
+	service_t item;
+	memset(&item, 0, sizeof(item));
+	item.pid = pid;
+	item.handle = handle;
+	item.found = ctx && load_service(&item, ctx) == 0;
+
+	VECTOR_PUSH(service_t, &services, item);
+	service_t *data = VECTOR_DATA(service_t, &services);
+	memmove(data + lo + 1, data + lo, (sz - lo) * sizeof(service_t));
+	data[lo] = item;
+	return data[lo].found ? data[lo].name : NULL;
+}
+
+// address of the static H of skynet_handle.c in pid, 0 when not found
+static unsigned long long find_handle_storage(int pid) {
+	running_maps_t *maps = create_maps(pid);
+	if (maps == NULL) {
+		return 0;
+	}
+
+	unsigned long long addr = 0;
+	for (int i = 0; i < maps->count && addr == 0; i++) {
+		map_item_t *item = &maps->item[i];
+		const Elf64_Sym *sym = find_symname_address(&item->elf, "H");
+		if (sym == NULL || ELF64_ST_TYPE(sym->st_info) != STT_OBJECT
+				|| sym->st_size != sizeof(void *)) {
+			continue;
+		}
+		addr = sym->st_value;
+		if (item->elf.header->e_type == ET_DYN) {
+			addr += item->addr_start - item->addr_offset;
+		}
+	}
+	free_maps(maps);
+	return addr;
+}
+
+int skynet_lua_globals(int pid, VECTOR_TYPE(unsigned long long) *globals) {
+	unsigned long long addr = find_handle_storage(pid);
+	struct handle_storage *h;
+	struct handle_storage hs;
+	if (addr == 0 || read_target(pid, &h, (void *)addr, sizeof(h)) < 0 || h == NULL
+			|| read_target(pid, &hs, h, sizeof(hs)) < 0
+			|| hs.slot_size <= 0 || hs.slot_size > MAX_SLOT_SIZE) {
+		return -1;
+	}
+
+	struct skynet_context **slot = malloc(hs.slot_size * sizeof(*slot));
+	if (slot == NULL || read_target(pid, slot, hs.slot, hs.slot_size * sizeof(*slot)) < 0) {
+		free(slot);
+		return -1;
+	}
+
+	int count = 0;
+	for (int i = 0; i < hs.slot_size; i++) {
+		struct skynet_context ctx;
+		struct skynet_module mod;
+		struct snlua lua;
+		lua_State th;
+		char name[SERVICE_NAME_LEN];
+		if (slot[i] == NULL
+				|| read_target(pid, &ctx, slot[i], sizeof(ctx)) < 0
+				|| read_target(pid, &mod, ctx.mod, sizeof(mod)) < 0
+				|| read_cstr(pid, mod.name, name, sizeof(name)) < 0
+				|| strcmp(name, "snlua") != 0
+				|| read_target(pid, &lua, ctx.instance, sizeof(lua)) < 0
+				|| read_target(pid, &th, lua.L, sizeof(th)) < 0
+				|| th.l_G == NULL) {
+			continue;
+		}
+		unsigned long long g = (unsigned long long)th.l_G;
+		VECTOR_PUSH(unsigned long long, globals, g);
+		count++;
+	}
+	free(slot);
+	return count;
+}
+
+void skynet_init() {
+	VECTOR_INIT(service_t, &services);
+}
+
+void skynet_free() {
+	VECTOR_FREE(service_t, &services);
+}
+
+#else
+
+const char *skynet_service_name(int pid, unsigned int handle, unsigned long long ctx) {
+	return NULL;
+}
+
+int skynet_lua_globals(int pid, VECTOR_TYPE(unsigned long long) *globals) {
+	return -1;
+}
+
+void skynet_init() {
+}
+
+void skynet_free() {
+}
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef SKYNET_H
+#define SKYNET_H
+
+#include "vector.h"
+
+
+// name of service handle of process pid, whose skynet_context is at ctx in the
+// target: the SERVICE_NAME global of a snlua service, the module name of a c
+// service. names are read once and cached, NULL when ctx no longer holds handle
+const char *skynet_service_name(int pid, unsigned int handle, unsigned long long ctx);
+// push the global_State of every snlua service of pid, read from the handle
+// storage of skynet. returns the number of services pushed, -1 when the
+// storage can not be found, e.g. in a stripped skynet
+int skynet_lua_globals(int pid, VECTOR_TYPE(unsigned long long) *globals);
+void skynet_init();
+void skynet_free();
+
+#endif
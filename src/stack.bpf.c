@@ -8,13 +8,13 @@ char LICENSE[] SEC("license") = "Dual BSD/GPL";
 
 struct {
 	__uint(type, BPF_MAP_TYPE_RINGBUF);
-	__uint(max_entries, 1024); // 1K
+	__uint(max_entries, 16 * 1024 * 1024); // 16M
 } events SEC(".maps");
 
 struct {
 	__uint(type, BPF_MAP_TYPE_ARRAY);
 	__type(key, u32);
-	__type(value, u64);
+	__type(value, unwind_row_t);
 } fde_ip_map SEC(".maps");
 
 struct {
@@ -23,19 +23,215 @@ struct {
     __type(value, fde_state_t);
 } fde_state_map SEC(".maps");
 
+// {object, object relative ip >> UNWIND_PAGE_SHIFT} -> rows of that page
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, unwind_page_key_t);
+    __type(value, unwind_page_t);
+} fde_page_map SEC(".maps");
+
+// tgid -> profiled process, samples of other processes are ignored
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, u32);
+    __type(value, proc_info_t);
+} proc_info_map SEC(".maps");
+
+// executable mappings of every profiled process, see proc_info_t
 struct {
     __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, u32);
+    __type(value, proc_mapping_t);
+} proc_mapping_map SEC(".maps");
+
+// per-cpu scratch, a sample is unwound here and only the used frames are sent
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
 	__uint(max_entries, 1);
     __type(key, u32);
-    __type(value, luaV_execute_t);
-} luaV_execute_map SEC(".maps");
+    __type(value, deep_stack_t);
+} proc_stack_map SEC(".maps");
 
+// per-cpu staging of a new stack_agg_map value
 struct {
-    __uint(type, BPF_MAP_TYPE_ARRAY);
-	__uint(max_entries, MAX_STACK_DEEP);
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
     __type(key, u32);
     __type(value, proc_stack_t);
-} proc_stack_map SEC(".maps");
+} agg_stack_map SEC(".maps");
+
+// aggregate mode: stack hash -> stack, each unique stack is stored once and
+// only its weight is bumped on repeats. userspace drains it periodically and
+// sizes it, off-cpu and live heap stacks stay until the end and need more
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 8192);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, u64);
+    __type(value, proc_stack_t);
+} stack_agg_map SEC(".maps");
+
+// alloc mode: bytes allocated on this cpu since the last sample
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+    __type(key, u32);
+    __type(value, u64);
+} alloc_bytes_map SEC(".maps");
+
+// live heap mode: a sampled block and the bytes it stands for
+typedef struct live_alloc_t {
+	u64 hash; // allocating stack in stack_agg_map
+	u64 bytes;
+} live_alloc_t;
+
+// live heap mode: {pid, address} of a sampled block that is not freed yet.
+// not lru, an evicted block would stay charged and look like a leak, a block
+// that does not fit is left uncharged and counted in STAT_LIVE_UNTRACKED
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 65536);
+    __type(key, lua_addr_key_t);
+    __type(value, live_alloc_t);
+} live_alloc_map SEC(".maps");
+
+// live heap mode: tid -> block being allocated, its address comes at return
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 4096);
+    __type(key, u32);
+    __type(value, live_alloc_t);
+} live_pending_map SEC(".maps");
+
+// gc mode: tid -> start of the outermost gc call and its stack pointer at
+// entry, a call below it is nested. an error can longjmp past the return, the
+// next call at or above that stack pointer starts over
+typedef struct gc_start_t {
+	u64 ts;
+	u64 sp;
+} gc_start_t;
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 4096);
+    __type(key, u32);
+    __type(value, gc_start_t);
+} gc_start_map SEC(".maps");
+
+// gc mode: tgid -> pause histogram
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 1024);
+    __type(key, u32);
+    __type(value, hist_t);
+} gc_hist_map SEC(".maps");
+
+// latency mode: tid -> lua_State of the luaD_precall in progress
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 4096);
+    __type(key, u32);
+    __type(value, u64);
+} lat_state_map SEC(".maps");
+
+typedef struct lat_start_key_t {
+	u64 ci; // CallInfo of the call
+	u32 pid;
+	u32 reserved;
+} lat_start_key_t;
+
+typedef struct lat_start_t {
+	u64 ts;
+	u64 proto;
+	u32 source;
+	int linedefined;
+} lat_start_t;
+
+// latency mode: calls of selected functions that have not returned yet
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 16384);
+    __type(key, lat_start_key_t);
+    __type(value, lat_start_t);
+} lat_start_map SEC(".maps");
+
+typedef struct lat_frame_key_t {
+	u64 sp; // stack pointer at entry of luaV_execute
+	u32 tid;
+	u32 reserved;
+} lat_frame_key_t;
+
+// latency mode: luaV_execute call in progress -> its CallInfo, on 5.4 the
+// fast OP_RETURN0/OP_RETURN1 skip luaD_poscall, a frame called from c is
+// still closed when luaV_execute returns
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 4096);
+    __type(key, lat_frame_key_t);
+    __type(value, u64);
+} lat_frame_map SEC(".maps");
+
+// latency mode: the functions to time, filled by userspace as chunk names show up
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 1024);
+    __type(key, lat_filter_key_t);
+    __type(value, u8);
+} lat_filter_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 4096);
+    __type(key, func_hist_key_t);
+    __type(value, func_hist_t);
+} func_hist_map SEC(".maps");
+
+// snapshot mode: every global_State that ran lua while the probe was attached
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 16384);
+    __type(key, lua_global_key_t);
+    __type(value, u64);
+} lua_global_map SEC(".maps");
+
+// skynet: the service whose message a thread dispatches, depth counts the
+// probed calls it is inside, dispatch_message calls the snlua callbacks
+typedef struct sky_dispatch_t {
+	u32 handle;
+	u32 depth;
+} sky_dispatch_t;
+
+// skynet: tid -> service it dispatches a message of
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 4096);
+    __type(key, u32);
+    __type(value, sky_dispatch_t);
+} sky_dispatch_map SEC(".maps");
+
+// skynet: every service that dispatched a message -> its skynet_context, for
+// userspace to look the name up
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 65536);
+    __type(key, sky_service_key_t);
+    __type(value, u64);
+} sky_service_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, STAT_MAX);
+    __type(key, u32);
+    __type(value, u64);
+} stat_map SEC(".maps");
+
+// off-cpu mode: tid -> switch out time, lru so exited threads do not leak
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 16384);
+    __type(key, u32);
+    __type(value, offcpu_start_t);
+} offcpu_start_map SEC(".maps");
 
 
 
@@ -47,7 +243,12 @@ typedef struct table_unwind_t {
 	u32 fde_size;
 	u32 ustack_sz;
 	u32 lstack_sz;
+	u32 lua_fail; // a lua thread could not be walked to its base
+	u32 lua_trunc; // lua threads or frames past MAX_UNWIND_DEEP, counted once
+	u32 lua_abort; // a frame could not be read, the whole sample is dropped
 	luaV_execute_t *lt;
+	proc_info_t *info;
+	proc_mapping_t *mapping; // mapping of the previous frame, usually hit again
 	lua_ctx_t *lctx;
 	u64 *ustack;
 	lua_func_t *lstack;
@@ -55,38 +256,103 @@ typedef struct table_unwind_t {
 
 
 unsigned long FDE_IP_COUNT;
-int target_pid = 0;
+int aggregate_mode = 0;
+int wall_mode = 0; // weight in nanoseconds, stacks per thread and tagged on/off cpu
+unsigned long long alloc_sample_bytes = 0; // alloc mode takes one stack every that many bytes
+int live_mode = 0; // alloc mode keeps only the bytes not freed yet
+unsigned long long gc_min_ns = 0; // gc pauses at least that long get their stack
+
+
+static __always_inline u32 log2_u64(u64 v) {
+	u32 r = 0;
+	for (int i = 32; i > 0; i >>= 1) {
+		if (v >> i) {
+			v >>= i;
+			r += i;
+		}
+	}
+	return r;
+}
+
+static __always_inline void hist_add(hist_t *hist, u64 delta) {
+	u32 slot = log2_u64(delta / 1000);
+	if (slot >= HIST_SLOTS) {
+		slot = HIST_SLOTS - 1;
+	}
+	__sync_fetch_and_add(&hist->slots[slot], 1);
+	__sync_fetch_and_add(&hist->count, 1);
+	__sync_fetch_and_add(&hist->total_ns, delta);
+	if (delta > hist->max_ns) {
+		hist->max_ns = delta;
+	}
+}
 
-static u32 stack_cyc_id = 0;
 
+static __always_inline void stat_inc(u32 idx) {
+	u64 *v = bpf_map_lookup_elem(&stat_map, &idx);
+	if (v) {
+		*v += 1;
+	}
+}
 
-static __always_inline fde_state_t *search(u64 rip, u32 fde_size) {
+static __always_inline fde_state_t *search(unwind_page_t *pg, u64 rip, u32 fde_size) {
 	u32 i = 0;
-	s32 key = -1;
-	u32 left = 0;
+	unwind_row_t *row = NULL;
 
-	u32 right = fde_size;
-	while (i++ < 20 && left < right) {
-		u64 *tmpip;
+	u32 left = pg->first;
+	u32 right = pg->first + pg->count;
+	if (right > fde_size) {
+		right = fde_size;
+	}
+	while (i++ < UNWIND_PAGE_SEARCH && left < right) {
 		u32 mid = (left + right) / 2;
-		tmpip = bpf_map_lookup_elem(&fde_ip_map, &mid);
-		if (tmpip == NULL) {
+		unwind_row_t *tmp = bpf_map_lookup_elem(&fde_ip_map, &mid);
+		if (tmp == NULL) {
 			break;
 		}
 
-		if (*tmpip > rip) {
+		if (tmp->ip > rip) {
 			right = mid;
 		} else {
-			key = (s32)mid;
+			row = tmp;
 			left = mid + 1;
 		}
 	}
-	if (key == -1) {
+	if (row == NULL) {
 		return NULL;
 	}
+	u32 key = row->state;
 	return bpf_map_lookup_elem(&fde_state_map, &key);
 }
 
+static __always_inline proc_mapping_t *find_mapping(table_unwind_t *tu, u64 rip) {
+	proc_mapping_t *m = tu->mapping;
+	if (m && m->start <= rip && rip < m->end) {
+		return m;
+	}
+
+	u32 i = 0;
+	u32 left = tu->info->first_mapping;
+	u32 right = left + tu->info->mapping_count;
+	while (i++ < MAX_MAPPING_SEARCH && left < right) {
+		u32 mid = (left + right) / 2;
+		m = bpf_map_lookup_elem(&proc_mapping_map, &mid);
+		if (m == NULL) {
+			break;
+		}
+
+		if (rip < m->start) {
+			right = mid;
+		} else if (rip >= m->end) {
+			left = mid + 1;
+		} else {
+			tu->mapping = m;
+			return m;
+		}
+	}
+	return NULL;
+}
+
 static __always_inline u64 reg_enum_to_val(table_unwind_t *tu, u8 reg) {
 	switch (reg) {
 	case DWARF_RIP:
@@ -103,17 +369,33 @@ static __always_inline u64 reg_enum_to_val(table_unwind_t *tu, u8 reg) {
 	return 0;
 }
 
-static __always_inline u64 calc_reg(table_unwind_t *tu, fde_state_t *state, u8 reg, u64 cfa) {
-	u64 value, from;
+// rule is one of UNWIND_RULE_*, reg the dwarf register it restores
+static __always_inline u64 calc_reg(table_unwind_t *tu, fde_state_t *state, u32 rule, u8 reg, u64 cfa) {
+	s64 value;
+	u64 from;
 
-	if (reg >= DWARF_REGS) {
+	if (reg >= DWARF_REGS || rule >= UNWIND_RULES) {
 		return 0;
 	}
 
-	value = state->saved_registers[reg].value;
-	from = state->saved_registers[reg].from;
+	value = state->rule_value[rule];
+	from = state->rule_from[rule];
 
 	switch(from) {
+	case REG_ATEXP:
+	case REG_ISEXP: {
+		u8 base = state->rule_reg[rule];
+		if (base >= DWARF_REGS) {
+			return 0;
+		}
+		u64 addr = reg_enum_to_val(tu, base) + value;
+		if (from == REG_ISEXP) {
+			return addr;
+		}
+		u64 tmp;
+		int n = bpf_probe_read_user(&tmp, 8, (void *)addr);
+		return n == 0 ? tmp : 0;
+	}
 	case REG_UNUSED:
 		if (reg == DWARF_RIP) {
 			return 0;
@@ -161,8 +443,8 @@ static __always_inline int check_lua_rip(u64 rip, u64 reg, luaV_execute_t *lt, l
 
 		if (lctx->Lp != L) {
 			u32 i = lctx->lcount;
-			if (i >= MAX_STACK_DEEP) {
-				return -1;
+			if (i >= MAX_UNWIND_DEEP) {
+				return -2;
 			}
 			lthread_t *lthread = &lctx->lbuf[i];
 			lthread->L = L;
@@ -182,16 +464,50 @@ static int unwind_c(u32 index, void *ud) {
 	u64 cfa;
 
 	u32 stack_idx = tu->ustack_sz++;
-	if (tu->rip > 0 && stack_idx < MAX_STACK_DEEP) {
+	if (tu->rip > 0 && stack_idx < MAX_UNWIND_DEEP) {
 		tu->ustack[stack_idx] = tu->rip;
 	} else {
 		return LOOP_BREAK;
 	}
 
-	check_lua_rip(tu->rip, tu->regL, tu->lt, tu->lctx, stack_idx);
+	if (check_lua_rip(tu->rip, tu->regL, tu->lt, tu->lctx, stack_idx) == -2) {
+		tu->lua_trunc = 1;
+	}
+
+	proc_mapping_t *mapping = find_mapping(tu, tu->rip);
+	if (mapping == NULL) {
+		stat_inc(STAT_MAPPING_MISS);
+		return LOOP_BREAK;
+	}
+
+	u64 rel_ip = tu->rip - mapping->bias;
+	unwind_page_key_t page = {
+		.obj = mapping->obj,
+		.page = rel_ip >> UNWIND_PAGE_SHIFT,
+	};
+	unwind_page_t *pg = bpf_map_lookup_elem(&fde_page_map, &page);
+	if (pg == NULL) {
+		stat_inc(STAT_ROW_MISS);
+		return LOOP_BREAK;
+	}
+
+	// a caller always sits at a call site with its frame set up, only the leaf
+	// can be in a prologue or epilogue
+	if (index > 0 && (pg->flags & UNWIND_PAGE_FP)) {
+		u64 frame[2]; // saved rbp, return address
+		if (tu->rbp == 0 || bpf_probe_read_user(frame, sizeof(frame), (void *)tu->rbp) < 0) {
+			stat_inc(STAT_NATIVE_READ);
+			return LOOP_BREAK;
+		}
+		tu->rsp = tu->rbp + 16;
+		tu->rbp = frame[0];
+		tu->rip = frame[1];
+		return tu->rip == 0 ? LOOP_BREAK : LOOP_CONTINUE;
+	}
 
-	fde_state_t *state = search(tu->rip, tu->fde_size);
+	fde_state_t *state = search(pg, rel_ip, tu->fde_size);
 	if (state == NULL) {
+		stat_inc(STAT_ROW_MISS);
 		return LOOP_BREAK;
 	}
 
@@ -200,15 +516,32 @@ static int unwind_c(u32 index, void *ud) {
 		return LOOP_BREAK;
 	}
 
-	if (!state->cfa_expression) {
-		cfa = reg_enum_to_val(tu, tmpidx) + state->cfa_offset;
-	} else {
+	cfa = reg_enum_to_val(tu, tmpidx) + state->cfa_offset;
+	switch (state->cfa_rule) {
+	case CFA_RULE_REG:
+		break;
+	case CFA_RULE_PLT:
+		if ((tu->rip & 15) >= state->cfa_arg) {
+			cfa += 8;
+		}
+		break;
+	case CFA_RULE_DEREF:
+		if (bpf_probe_read_user(&cfa, sizeof(cfa), (void *)cfa) < 0) {
+			stat_inc(STAT_NATIVE_READ);
+			return LOOP_BREAK;
+		}
+		break;
+	default:
 		return LOOP_BREAK;
 	}
 
-	tu->rbp = calc_reg(tu, state, DWARF_RBP, cfa);
-	tu->rip = calc_reg(tu, state, DWARF_RIP, cfa);
-	tu->regL = calc_reg(tu, state, tu->lt->lstate.reg, cfa);
+	// every rule reads the registers of this frame, update them only at the end
+	u64 rbp = calc_reg(tu, state, UNWIND_RULE_RBP, DWARF_RBP, cfa);
+	u64 rip = calc_reg(tu, state, UNWIND_RULE_RIP, DWARF_RIP, cfa);
+	u64 regL = calc_reg(tu, state, UNWIND_RULE_LREG, tu->lt->lstate.reg, cfa);
+	tu->rbp = rbp;
+	tu->rip = rip;
+	tu->regL = regL;
 	tu->rsp = cfa;
 	// CLOG("[%d] cal rip: %lx, rsp: %lx, rbp: %lx\n", index, tu->rip, tu->rsp, tu->rbp);
 
@@ -224,27 +557,31 @@ static __always_inline int collect_lua_proto(table_unwind_t *tu, u32 ustack_idx)
 	lua_ctx_t *ctx = tu->lctx;
 
 	u32 idx = tu->lstack_sz;
-	if (idx >= MAX_STACK_DEEP) {
+	if (idx >= MAX_UNWIND_DEEP) {
 		return -1;
 	}
 
 	lua_func_t *lfunc = &tu->lstack[idx];
 	lfunc->lv_idx = ustack_idx;
 	if (isLua(&ctx->ci)) {
-		read_lua_proto(ctx);
-		if (ctx->proto.linedefined < 0 || ctx->proto.lastlinedefined < 0) {
+		if (read_lua_proto(ctx) < 0) {
 			return -2;
 		}
-		lfunc->u.l.startline = ctx->proto.linedefined;
-		lfunc->u.l.endline = ctx->proto.lastlinedefined;
-		lfunc->u.l.currline = currentline(&ctx->ci, &ctx->proto);
-		lfunc->flag = ctx->ci.callstatus; // set c addr flag
-		if (read_lua_file(lfunc, ctx->proto.source) < 0) {
+		if (ctx->proto.linedefined < 0 || ctx->proto.lastlinedefined < 0) {
 			return -2;
 		}
-		// CLOG("func: %d ,%d, source: %s", lfunc->u.l.startline, lfunc->u.l.endline, lfunc->u.l.file);
+		lfunc->startline = ctx->proto.linedefined;
+		lfunc->endline = ctx->proto.lastlinedefined;
+		// the line is looked up in userspace, walking lineinfo here costs a read per instruction
+		lfunc->currline = -1;
+		lfunc->pc = currentpc(&ctx->ci, &ctx->proto);
+		lfunc->proto = (u64)ctx->p;
+		lfunc->flag = ctx->ci.callstatus; // set c addr flag
+		lfunc->source = ctx->source;
+		// CLOG("func: %d ,%d, source: %u", lfunc->startline, lfunc->endline, lfunc->source);
 	} else {
 		lfunc->flag = -1; // set c addr flag
+		lfunc->source = 0;
 	}
 
 	tu->lstack_sz++;
@@ -257,27 +594,43 @@ static int unwind_lua(u32 index, void *ud) {
 	bool next_thread = false;
 	u32 idx = ctx->lthread_idx;
 
-	if (idx >= ctx->lcount || idx >= MAX_STACK_DEEP) {
+	if (idx >= ctx->lcount || idx >= MAX_UNWIND_DEEP) {
 		return LOOP_BREAK;
 	}
 
 	lthread_t *co = &ctx->lbuf[idx];
 	if (!ctx->Lp) {
-		read_user_data_ret(ctx->L, co->L, LOOP_BREAK);
+		if (bpf_probe_read_user(&ctx->L, sizeof(ctx->L), co->L) < 0) {
+			stat_inc(STAT_LUA_READ);
+			tu->lua_fail = 1;
+			return LOOP_BREAK;
+		}
 		ctx->Lp = &ctx->L;
 		ctx->cip = ctx->L.ci;
 	}
 
+	// base_ci has no previous, the thread is done
+	if (!ctx->cip) {
+		next_thread = true;
+		goto next;
+	}
+
 	if (bpf_probe_read_user(&ctx->ci, sizeof(CallInfo), ctx->cip) < 0) {
+		stat_inc(STAT_LUA_READ);
+		tu->lua_fail = 1;
 		next_thread = true;
 		goto next;
 	}
 
 	idx = collect_lua_proto(tu, co->ustack_idx); // reuse idx
 	if (idx == -1) {
+		tu->lua_trunc = 1;
+		tu->lua_fail = 1;
 		next_thread = true;
 	} else if (idx == -2) {
-		tu->ustack_sz = tu->lstack_sz = 0; // Skip this collection
+		stat_inc(STAT_LUA_ABORT);
+		tu->lua_fail = 1;
+		tu->lua_abort = 1;
 		return LOOP_BREAK;
 	}
 
@@ -293,67 +646,213 @@ next:
 }
 
 
-static int commit_unwind_info(table_unwind_t *tu) {
-	struct stacktrace_event_t *event;
-	event = bpf_ringbuf_reserve(&events, sizeof(*event), 0);
-	if (!event)
-		return 1;
+typedef struct stack_hash_t {
+	u64 hash;
+	deep_stack_t *stk;
+} stack_hash_t;
+
+static __always_inline u64 hash_u64(u64 hash, u64 value) {
+	hash ^= value;
+	return hash * STACK_HASH_PRIME;
+}
 
-	int cpu_id = bpf_get_smp_processor_id();
+static int hash_native_frame(u32 index, void *ud) {
+	stack_hash_t *sh = (stack_hash_t *)ud;
+	if (index >= MAX_UNWIND_DEEP) {
+		return LOOP_BREAK;
+	}
 
-	event->pid = target_pid;
-	event->cpu_id = cpu_id;
+	sh->hash = hash_u64(sh->hash, sh->stk->ustack[index]);
+	return LOOP_CONTINUE;
+}
 
-	if (bpf_get_current_comm(event->comm, sizeof(event->comm)))
-		event->comm[0] = 0;
+static int hash_lua_frame(u32 index, void *ud) {
+	stack_hash_t *sh = (stack_hash_t *)ud;
+	if (index >= MAX_UNWIND_DEEP) {
+		return LOOP_BREAK;
+	}
 
-	event->stack_map_idx = stack_cyc_id;
-	bpf_ringbuf_submit(event, 0);
-	return 0;
+	// the pc stays in the key, userspace folds the pcs of one line together
+	lua_func_t *lfunc = &sh->stk->lstack[index];
+	u64 hash = hash_u64(sh->hash, ((u64)lfunc->lv_idx << 32) | (u32)lfunc->flag);
+	if (lfunc->flag >= 0) {
+		hash = hash_u64(hash, lfunc->source);
+		hash = hash_u64(hash, ((u64)lfunc->startline << 32) | (u32)lfunc->endline);
+		hash = hash_u64(hash, lfunc->pc);
+	}
+
+	sh->hash = hash;
+	return LOOP_CONTINUE;
 }
 
+static __always_inline u64 hash_stack(deep_stack_t *stk) {
+	stack_hash_t sh = {
+		.hash = hash_u64(hash_u64(hash_u64(STACK_HASH_SEED, stk->pid),
+			((u64)stk->tid << 32) | stk->state), stk->service),
+		.stk = stk,
+	};
+
+	bpf_loop(stk->ustack_sz, hash_native_frame, &sh, 0);
+	sh.hash = hash_u64(sh.hash, stk->ustack_sz);
+	bpf_loop(stk->lstack_sz, hash_lua_frame, &sh, 0);
+	return hash_u64(sh.hash, stk->lstack_sz);
+}
 
-SEC("perf_event")
-int profile(struct bpf_perf_event_data *ctx) {
-	bpf_user_pt_regs_t *regs = &ctx->regs;
+// copy stk into a stack_agg_map value, frames past MAX_STACK_DEEP are cut at
+// the root end
+static __always_inline void copy_agg_stack(proc_stack_t *dst, deep_stack_t *src) {
+	u32 ksz = src->kstack_sz;
+	u32 usz = src->ustack_sz;
+	u32 lsz = src->lstack_sz;
+	if (ksz > MAX_STACK_DEEP)
+		ksz = MAX_STACK_DEEP;
+	if (usz > MAX_STACK_DEEP)
+		usz = MAX_STACK_DEEP;
+	if (lsz > MAX_STACK_DEEP)
+		lsz = MAX_STACK_DEEP;
+
+	dst->weight = src->weight;
+	dst->pid = src->pid;
+	dst->tid = src->tid;
+	dst->state = src->state;
+	dst->service = src->service;
+	dst->kstack_sz = ksz;
+	dst->ustack_sz = usz;
+	dst->lstack_sz = lsz;
+	bpf_probe_read_kernel(dst->kstack, ksz * sizeof(u64), src->kstack);
+	bpf_probe_read_kernel(dst->ustack, usz * sizeof(u64), src->ustack);
+	bpf_probe_read_kernel(dst->lstack, lsz * sizeof(lua_func_t), src->lstack);
+}
 
-	int pid = bpf_get_current_pid_tgid() >> 32;
-	if (pid != target_pid)
+// return 0 when the sample is folded into stack_agg_map, otherwise the map is full
+static __always_inline int aggregate_stack(u64 hash, deep_stack_t *stk) {
+	proc_stack_t *agg = bpf_map_lookup_elem(&stack_agg_map, &hash);
+	if (agg) {
+		__sync_fetch_and_add(&agg->weight, stk->weight);
 		return 0;
+	}
 
-	proc_stack_t *stk = bpf_map_lookup_elem(&proc_stack_map, &stack_cyc_id);
-	if (!stk) {
-		return 1;
+	proc_stack_t *tmp = lookup_map(agg_stack_map);
+	if (!tmp) {
+		return -1;
+	}
+	copy_agg_stack(tmp, stk);
+	if (!bpf_map_update_elem(&stack_agg_map, &hash, tmp, BPF_NOEXIST)) {
+		return 0;
+	}
+
+	// another cpu may have inserted the same stack in the meantime
+	agg = bpf_map_lookup_elem(&stack_agg_map, &hash);
+	if (agg) {
+		__sync_fetch_and_add(&agg->weight, stk->weight);
+		return 0;
+	}
+	return -1;
+}
+
+// send only the used part of stk as one stack_sample_t record
+static __always_inline int commit_unwind_info(deep_stack_t *stk) {
+	struct bpf_dynptr ptr;
+	stack_sample_t hdr = {};
+
+	hdr.pid = stk->pid;
+	hdr.tid = stk->tid;
+	hdr.state = stk->state;
+	hdr.service = stk->service;
+	hdr.cpu_id = bpf_get_smp_processor_id();
+	if (bpf_get_current_comm(hdr.comm, sizeof(hdr.comm)))
+		hdr.comm[0] = 0;
+
+	u32 ksz = stk->kstack_sz;
+	u32 usz = stk->ustack_sz;
+	u32 lsz = stk->lstack_sz;
+	if (ksz > MAX_STACK_DEEP || usz > MAX_UNWIND_DEEP || lsz > MAX_UNWIND_DEEP) {
+		return -1;
+	}
+
+	hdr.weight = stk->weight;
+	hdr.kstack_sz = ksz;
+	hdr.ustack_sz = usz;
+	hdr.lstack_sz = lsz;
+
+	ksz *= sizeof(u64);
+	usz *= sizeof(u64);
+	lsz *= sizeof(lua_func_t);
+
+	// a failed reservation still has to be discarded
+	if (bpf_ringbuf_reserve_dynptr(&events, sizeof(hdr) + ksz + usz + lsz, 0, &ptr)) {
+		bpf_ringbuf_discard_dynptr(&ptr, 0);
+		stat_inc(STAT_RINGBUF_DROP);
+		return -1;
 	}
+
+	bpf_dynptr_write(&ptr, 0, &hdr, sizeof(hdr), 0);
+	bpf_dynptr_write(&ptr, sizeof(hdr), stk->kstack, ksz, 0);
+	bpf_dynptr_write(&ptr, sizeof(hdr) + ksz, stk->ustack, usz, 0);
+	bpf_dynptr_write(&ptr, sizeof(hdr) + ksz + usz, stk->lstack, lsz, 0);
+	bpf_ringbuf_submit_dynptr(&ptr, 0);
+	return 0;
+}
+
+// hand a sample to userspace, in aggregate mode it is folded into stack_agg_map
+// and the ring buffer is the fallback when the map is full
+static __always_inline void submit_stack(deep_stack_t *stk) {
+	// a deep stack does not fit stack_agg_map, the ring buffer takes it whole
+	if (aggregate_mode && stk->ustack_sz <= MAX_STACK_DEEP && stk->lstack_sz <= MAX_STACK_DEEP) {
+		if (!aggregate_stack(hash_stack(stk), stk)) {
+			return;
+		}
+		stat_inc(STAT_AGG_FULL);
+	}
+	commit_unwind_info(stk);
+}
+
+// the skynet service current task dispatches a message of, 0 when it is idle
+// or the process is not skynet
+static __always_inline u32 current_service(void) {
+	u32 tid = (u32)bpf_get_current_pid_tgid();
+	sky_dispatch_t *d = bpf_map_lookup_elem(&sky_dispatch_map, &tid);
+	return d ? d->handle : 0;
+}
+
+// unwind the native and lua stack of current task into stk, return 0 on success,
+// -1 when the sample is to be dropped. regs are the sampled registers, NULL
+// reads the user registers the task saved when it entered the kernel
+static __always_inline int unwind_stack(void *ctx, bpf_user_pt_regs_t *regs, deep_stack_t *stk,
+			u32 pid, proc_info_t *info) {
 	table_unwind_t tu;
 	tu.fde_size = FDE_IP_COUNT;
 	tu.lctx = init_lua_ctx_map();
-	tu.lt = lookup_map(luaV_execute_map);
+	tu.lt = &info->lt;
+	tu.info = info;
+	tu.mapping = NULL;
 	tu.ustack = stk->ustack;
 	tu.ustack_sz = 0;
 	tu.lstack = stk->lstack;
 	tu.lstack_sz = 0;
-
+	tu.lua_fail = 0;
+	tu.lua_trunc = 0;
+	tu.lua_abort = 0;
+
+	stk->weight = 1;
+	stk->pid = pid;
+	stk->tid = wall_mode ? (u32)bpf_get_current_pid_tgid() : 0;
+	stk->state = 0;
+	stk->service = current_service();
 	stk->kstack_sz = 0;
 	stk->ustack_sz = 0;
 	stk->lstack_sz = 0;
-	bpf_map_update_elem(&proc_stack_map, &stack_cyc_id, stk, 0);
 
 	if (!tu.lt) {
-		return 1;
+		return -1;
 	}
+	stat_inc(STAT_SAMPLES);
 
-	// #ifdef 
-	#if (defined LUA54 || defined LUASKY)
-		CLOG("---- use lua54");
-	#else
-		// CLOG("---- use lua53");
-	#endif
-
-	if (in_kernel(PT_REGS_IP(regs))) {
+	if (!regs || in_kernel(PT_REGS_IP(regs))) {
 		if (!retrieve_task_registers(&tu.rip, &tu.rsp, &tu.rbp, tu.lt->lstate.reg, &tu.regL)) {
 			// in kernelspace, but failed, probs a kworker
-			return 1;
+			stat_inc(STAT_REGS_FAIL);
+			return -1;
 		}
 	} else {
 		// in userspace
@@ -365,32 +864,551 @@ int profile(struct bpf_perf_event_data *ctx) {
 		// -- dereference of modified ctx ptr R1 off=96 disallowed
 		bpf_user_pt_regs_t tmp = *regs;
 		if (!find_reg_user(tu.lt->lstate.reg, &tmp, &tu.regL)) {
-			return 1;
+			stat_inc(STAT_REGS_FAIL);
+			return -1;
 		}
 	}
 
-	int n = bpf_loop(MAX_STACK_DEEP, unwind_c, &tu, 0);
+	// bpf_loop keeps the program size flat however deep the walk goes
+	int n = bpf_loop(MAX_UNWIND_DEEP, unwind_c, &tu, 0);
 	if (n < 0) {
-		return 0;
+		return -1;
+	}
+	// every round went on to a caller, there is more stack
+	if (n == MAX_UNWIND_DEEP && tu.rip) {
+		stat_inc(STAT_NATIVE_TRUNC);
 	}
 
 	if (tu.lctx && tu.lctx->lcount > 0) {
 		tu.lctx->Lp = NULL;
-		n = bpf_loop(MAX_STACK_DEEP, unwind_lua, &tu, 0);
+		n = bpf_loop(MAX_UNWIND_DEEP, unwind_lua, &tu, 0);
+		if (!tu.lua_fail && tu.lctx->lthread_idx >= tu.lctx->lcount) {
+			stat_inc(STAT_LUA_COMPLETE);
+		} else if (!tu.lua_fail) {
+			tu.lua_trunc = 1;
+		}
+	} else {
+		stat_inc(STAT_LUA_MISS);
+	}
+	if (tu.lua_trunc) {
+		stat_inc(STAT_LUA_TRUNC);
+	}
+	// an empty stack would only add weight to the root
+	if (tu.lua_abort || tu.ustack_sz == 0) {
+		return -1;
 	}
 
-	stk->kstack_sz = bpf_get_stack(ctx, stk->kstack, sizeof(stk->kstack), 0);
+	n = bpf_get_stack(ctx, stk->kstack, sizeof(stk->kstack), 0);
+	stk->kstack_sz = n > 0 ? n / sizeof(u64) : 0;
 	stk->lstack_sz = tu.lstack_sz;
 	stk->ustack_sz = tu.ustack_sz;
+	return 0;
+}
+
 
-	if (!bpf_map_update_elem(&proc_stack_map, &stack_cyc_id, stk, 0)) {
-		commit_unwind_info(&tu);
+SEC("perf_event")
+int profile(struct bpf_perf_event_data *ctx) {
+	u32 pid = bpf_get_current_pid_tgid() >> 32;
+	proc_info_t *info = bpf_map_lookup_elem(&proc_info_map, &pid);
+	if (!info)
+		return 0;
+
+	deep_stack_t *stk = lookup_map(proc_stack_map);
+	if (!stk) {
+		return 1;
+	}
+
+	if (unwind_stack(ctx, &ctx->regs, stk, pid, info) < 0) {
+		return 1;
+	}
+
+	// the period is in units of the event, nanoseconds for cpu clock, so runs
+	// at different frequencies add up the same
+	stk->weight = ctx->sample_period;
+	if (wall_mode) {
+		stk->state = STACK_STATE_ONCPU;
+	}
+
+	submit_stack(stk);
+	return 0;
+}
+
+SEC("tp_btf/sched_switch")
+int BPF_PROG(offcpu, bool preempt, struct task_struct *prev, struct task_struct *next) {
+	u64 now = bpf_ktime_get_ns();
+
+	// next was switched out by a profiled process, charge it the time it was away
+	u32 tid = next->pid;
+	offcpu_start_t *start = bpf_map_lookup_elem(&offcpu_start_map, &tid);
+	if (start) {
+		proc_stack_t *agg = bpf_map_lookup_elem(&stack_agg_map, &start->hash);
+		if (agg && now > start->ts) {
+			__sync_fetch_and_add(&agg->weight, now - start->ts);
+		}
+		bpf_map_delete_elem(&offcpu_start_map, &tid);
+	}
+
+	// current is still prev, its user registers and memory can be read
+	u64 pid_tgid = bpf_get_current_pid_tgid();
+	u32 pid = pid_tgid >> 32;
+	proc_info_t *info = bpf_map_lookup_elem(&proc_info_map, &pid);
+	if (!info)
+		return 0;
+
+	deep_stack_t *stk = lookup_map(proc_stack_map);
+	if (!stk) {
+		return 0;
+	}
+
+	if (unwind_stack(ctx, NULL, stk, pid, info) < 0) {
+		return 0;
+	}
+
+	// the weight is only known when the thread is switched in again
+	stk->weight = 0;
+	if (wall_mode) {
+		stk->state = STACK_STATE_OFFCPU;
+	}
+	offcpu_start_t item = {
+		.ts = now,
+		.hash = hash_stack(stk),
+	};
+	if (aggregate_stack(item.hash, stk) < 0) {
+		stat_inc(STAT_AGG_DROP);
+		return 0;
+	}
+
+	tid = (u32)pid_tgid;
+	bpf_map_update_elem(&offcpu_start_map, &tid, &item, BPF_ANY);
+	return 0;
+}
+
+// add bytes to the stack that allocated a live block, negative on free
+static __always_inline void charge_live(live_alloc_t *live, u64 bytes) {
+	proc_stack_t *agg = bpf_map_lookup_elem(&stack_agg_map, &live->hash);
+	if (agg) {
+		__sync_fetch_and_add(&agg->weight, bytes);
+	}
+}
+
+// the lua_Alloc of the host, l_alloc in lauxlib or skynet's lalloc
+SEC("uprobe")
+int BPF_KPROBE(lua_alloc, void *ud, void *ptr, size_t osize, size_t nsize) {
+	u64 pid_tgid = bpf_get_current_pid_tgid();
+	u32 pid = pid_tgid >> 32;
+	u32 tid = (u32)pid_tgid;
+	proc_info_t *info = bpf_map_lookup_elem(&proc_info_map, &pid);
+	if (!info)
+		return 0;
+
+	// a sampled block is freed or moved, a move is charged again at return
+	if (live_mode && ptr) {
+		lua_addr_key_t key = {
+			.pid = pid,
+			.addr = (u64)ptr,
+		};
+		live_alloc_t *live = bpf_map_lookup_elem(&live_alloc_map, &key);
+		if (live) {
+			live_alloc_t moved = *live;
+			bpf_map_delete_elem(&live_alloc_map, &key);
+			charge_live(&moved, -moved.bytes);
+			if (nsize > 0) {
+				bpf_map_update_elem(&live_pending_map, &tid, &moved, BPF_ANY);
+			}
+			return 0;
+		}
+	}
+
+	// osize is the type of the new object when ptr is NULL
+	u64 old = ptr ? osize : 0;
+	if (nsize <= old) {
+		return 0;
+	}
+
+	u64 *bytes = lookup_map(alloc_bytes_map);
+	if (!bytes) {
+		return 0;
 	}
 
-	stack_cyc_id++;
-	if (stack_cyc_id >= MAX_STACK_DEEP) {
-		stack_cyc_id = 0;
+	// the allocation that crosses the threshold carries every byte since the
+	// last sample, so the totals stay right while most calls return here
+	u64 total = *bytes + nsize - old;
+	if (total < alloc_sample_bytes) {
+		*bytes = total;
+		return 0;
+	}
+	*bytes = 0;
+
+	deep_stack_t *stk = lookup_map(proc_stack_map);
+	if (!stk) {
+		return 0;
+	}
+
+	if (unwind_stack(ctx, (bpf_user_pt_regs_t *)ctx, stk, pid, info) < 0) {
+		return 0;
+	}
+
+	stk->weight = total;
+	if (!live_mode) {
+		submit_stack(stk);
+		return 0;
+	}
+
+	// the block counts once its address is known
+	stk->weight = 0;
+	live_alloc_t item = {
+		.hash = hash_stack(stk),
+		.bytes = total,
+	};
+	if (aggregate_stack(item.hash, stk) < 0) {
+		stat_inc(STAT_AGG_DROP);
+		return 0;
+	}
+	bpf_map_update_elem(&live_pending_map, &tid, &item, BPF_ANY);
+	return 0;
+}
+
+SEC("uretprobe")
+int BPF_KRETPROBE(lua_alloc_ret, void *ret) {
+	u64 pid_tgid = bpf_get_current_pid_tgid();
+	u32 tid = (u32)pid_tgid;
+	live_alloc_t *pending = bpf_map_lookup_elem(&live_pending_map, &tid);
+	if (!pending) {
+		return 0;
+	}
+
+	live_alloc_t live = *pending;
+	bpf_map_delete_elem(&live_pending_map, &tid);
+
+	lua_addr_key_t key = {
+		.pid = pid_tgid >> 32,
+		.addr = (u64)ret,
+	};
+	if (key.addr == 0) {
+		return 0;
+	}
+	if (bpf_map_update_elem(&live_alloc_map, &key, &live, BPF_ANY)) {
+		stat_inc(STAT_LIVE_UNTRACKED);
+		return 0;
+	}
+	charge_live(&live, live.bytes);
+	return 0;
+}
+
+// gc entry points, luaC_step and luaC_fullgc and on 5.4 youngcollection and
+// fullgen. they nest, only the outermost call is a pause
+SEC("uprobe")
+int gc_enter(struct pt_regs *ctx) {
+	u64 pid_tgid = bpf_get_current_pid_tgid();
+	u32 pid = pid_tgid >> 32;
+	u32 tid = (u32)pid_tgid;
+	if (!bpf_map_lookup_elem(&proc_info_map, &pid))
+		return 0;
+
+	u64 sp = PT_REGS_SP(ctx);
+	gc_start_t *start = bpf_map_lookup_elem(&gc_start_map, &tid);
+	if (start && sp < start->sp) {
+		return 0;
+	}
+
+	gc_start_t item = {
+		.ts = bpf_ktime_get_ns(),
+		.sp = sp,
+	};
+	bpf_map_update_elem(&gc_start_map, &tid, &item, BPF_ANY);
+	return 0;
+}
+
+SEC("uretprobe")
+int gc_exit(struct pt_regs *ctx) {
+	u64 pid_tgid = bpf_get_current_pid_tgid();
+	u32 pid = pid_tgid >> 32;
+	u32 tid = (u32)pid_tgid;
+	gc_start_t *start = bpf_map_lookup_elem(&gc_start_map, &tid);
+	// the return address has been popped, only the outermost call is timed
+	if (!start || PT_REGS_SP(ctx) - 8 != start->sp) {
+		return 0;
 	}
 
+	u64 delta = bpf_ktime_get_ns() - start->ts;
+	bpf_map_delete_elem(&gc_start_map, &tid);
+
+	hist_t *hist = bpf_map_lookup_elem(&gc_hist_map, &pid);
+	if (!hist) {
+		hist_t zero = {};
+		bpf_map_update_elem(&gc_hist_map, &pid, &zero, BPF_NOEXIST);
+		hist = bpf_map_lookup_elem(&gc_hist_map, &pid);
+		if (!hist) {
+			return 0;
+		}
+	}
+
+	hist_add(hist, delta);
+
+	if (delta < gc_min_ns) {
+		return 0;
+	}
+
+	proc_info_t *info = bpf_map_lookup_elem(&proc_info_map, &pid);
+	if (!info) {
+		return 0;
+	}
+
+	deep_stack_t *stk = lookup_map(proc_stack_map);
+	if (!stk) {
+		return 0;
+	}
+
+	// back in the caller, the stack is the one that ran into the gc
+	if (unwind_stack(ctx, (bpf_user_pt_regs_t *)ctx, stk, pid, info) < 0) {
+		return 0;
+	}
+
+	stk->weight = delta;
+	submit_stack(stk);
+	return 0;
+}
+
+SEC("uprobe")
+int BPF_KPROBE(lat_precall, lua_State *L) {
+	u64 pid_tgid = bpf_get_current_pid_tgid();
+	u32 pid = pid_tgid >> 32;
+	u32 tid = (u32)pid_tgid;
+	if (!bpf_map_lookup_elem(&proc_info_map, &pid))
+		return 0;
+
+	u64 addr = (u64)L;
+	bpf_map_update_elem(&lat_state_map, &tid, &addr, BPF_ANY);
+	return 0;
+}
+
+// a lua function is set up when luaD_precall returns, L->ci is its CallInfo
+SEC("uretprobe")
+int BPF_KRETPROBE(lat_precall_ret, long ret) {
+	u64 pid_tgid = bpf_get_current_pid_tgid();
+	u32 tid = (u32)pid_tgid;
+	u64 *state = bpf_map_lookup_elem(&lat_state_map, &tid);
+	if (!state) {
+		return 0;
+	}
+	lua_State *L = (lua_State *)*state;
+	bpf_map_delete_elem(&lat_state_map, &tid);
+
+	// c functions have already run inside luaD_precall
+#if (defined LUA54 || defined LUASKY)
+	if (ret == 0) {
+		return 0;
+	}
+#else
+	if ((int)ret != 0) {
+		return 0;
+	}
+#endif
+
+	lua_ctx_t *lctx = init_lua_ctx_map();
+	if (!lctx) {
+		return 0;
+	}
+	read_user_data_ret(lctx->L, L, 0);
+	read_user_data_ret(lctx->ci, lctx->L.ci, 0);
+	if (read_lua_proto(lctx) < 0) {
+		return 0;
+	}
+
+	// a call that unwound by an error or a 5.4 fast return left its entry
+	// behind, this call reuses the CallInfo
+	lat_start_key_t key = {
+		.ci = (u64)lctx->L.ci,
+		.pid = pid_tgid >> 32,
+	};
+	bpf_map_delete_elem(&lat_start_map, &key);
+
+	lat_filter_key_t filter = {
+		.source = lctx->source,
+		.linedefined = lctx->proto.linedefined,
+	};
+	if (!bpf_map_lookup_elem(&lat_filter_map, &filter)) {
+		return 0;
+	}
+
+	lat_start_t start = {
+		.ts = bpf_ktime_get_ns(),
+		.proto = (u64)lctx->p,
+		.source = filter.source,
+		.linedefined = filter.linedefined,
+	};
+	bpf_map_update_elem(&lat_start_map, &key, &start, BPF_ANY);
+	return 0;
+}
+
+// Proto of the lua function in CallInfo ci, 0 when it runs a c function
+static __always_inline u64 lat_ci_proto(u64 ci) {
+	CallInfo c;
+	GCObject *gc;
+	Proto *p;
+	read_user_data_ret(c, (void *)ci, 0);
+	if (!isLua(&c)) {
+		return 0;
+	}
+#if (defined LUA54 || defined LUASKY)
+	StackValue func;
+	read_user_data_ret(func, c.func.p, 0);
+	if (!ttisLclosure(&func.val)) {
+		return 0;
+	}
+	gc = func.val.value_.gc;
+#else
+	TValue func;
+	read_user_data_ret(func, c.func, 0);
+	if (!ttisLclosure(&func)) {
+		return 0;
+	}
+	gc = func.value_.gc;
+#endif
+	read_user_data_ret(p, &((Closure *)gc)->l.p, 0);
+	return (u64)p;
+}
+
+static __always_inline void lat_finish(u32 pid, u64 ci) {
+	lat_start_key_t key = {
+		.ci = ci,
+		.pid = pid,
+	};
+	lat_start_t *start = bpf_map_lookup_elem(&lat_start_map, &key);
+	if (!start) {
+		return;
+	}
+	// an entry left by a call that never returned here, the CallInfo now
+	// belongs to another function
+	if (lat_ci_proto(ci) != start->proto) {
+		bpf_map_delete_elem(&lat_start_map, &key);
+		return;
+	}
+
+	u64 delta = bpf_ktime_get_ns() - start->ts;
+	func_hist_key_t hkey = {
+		.pid = pid,
+		.proto = start->proto,
+	};
+	func_hist_t *fh = bpf_map_lookup_elem(&func_hist_map, &hkey);
+	if (!fh) {
+		func_hist_t zero = {
+			.source = start->source,
+			.linedefined = start->linedefined,
+		};
+		bpf_map_update_elem(&func_hist_map, &hkey, &zero, BPF_NOEXIST);
+		fh = bpf_map_lookup_elem(&func_hist_map, &hkey);
+	}
+	bpf_map_delete_elem(&lat_start_map, &key);
+	if (fh) {
+		hist_add(&fh->hist, delta);
+	}
+}
+
+SEC("uprobe")
+int BPF_KPROBE(lat_poscall, lua_State *L, CallInfo *ci) {
+	lat_finish(bpf_get_current_pid_tgid() >> 32, (u64)ci);
+	return 0;
+}
+
+SEC("uprobe")
+int BPF_KPROBE(lat_execute, lua_State *L, CallInfo *ci) {
+	u64 pid_tgid = bpf_get_current_pid_tgid();
+	u32 pid = pid_tgid >> 32;
+	if (!bpf_map_lookup_elem(&proc_info_map, &pid))
+		return 0;
+
+	lat_frame_key_t key = {
+		.sp = PT_REGS_SP(ctx),
+		.tid = (u32)pid_tgid,
+	};
+	u64 addr = (u64)ci;
+	bpf_map_update_elem(&lat_frame_map, &key, &addr, BPF_ANY);
+	return 0;
+}
+
+// the return address has been popped, sp is one slot above the entry one
+SEC("uretprobe")
+int BPF_KRETPROBE(lat_execute_ret) {
+	u64 pid_tgid = bpf_get_current_pid_tgid();
+	lat_frame_key_t key = {
+		.sp = PT_REGS_SP(ctx) - 8,
+		.tid = (u32)pid_tgid,
+	};
+	u64 *ci = bpf_map_lookup_elem(&lat_frame_map, &key);
+	if (!ci) {
+		return 0;
+	}
+	u64 addr = *ci;
+	bpf_map_delete_elem(&lat_frame_map, &key);
+	lat_finish(pid_tgid >> 32, addr);
+	return 0;
+}
+
+// luaV_execute takes lua_State first on 5.3 and 5.4, one entry per state is
+// enough to find the global_State of a service
+SEC("uprobe")
+int BPF_KPROBE(snap_state, lua_State *L) {
+	u32 pid = bpf_get_current_pid_tgid() >> 32;
+	if (!bpf_map_lookup_elem(&proc_info_map, &pid))
+		return 0;
+
+	lua_global_key_t key = {
+		.pid = pid,
+	};
+	if (bpf_probe_read_user(&key.g, sizeof(key.g), &L->l_G) < 0 || key.g == 0) {
+		return 0;
+	}
+	u64 addr = (u64)L;
+	bpf_map_update_elem(&lua_global_map, &key, &addr, BPF_NOEXIST);
+	return 0;
+}
+
+// skynet: dispatch_message and the message callbacks of snlua take the
+// skynet_context first, the handle stays set until the outermost call returns
+SEC("uprobe")
+int BPF_KPROBE(sky_dispatch, void *context) {
+#ifdef LUASKY
+	u64 pid_tgid = bpf_get_current_pid_tgid();
+	u32 tid = (u32)pid_tgid;
+	// a nested call only counts, the outermost one tagged the thread
+	sky_dispatch_t *d = bpf_map_lookup_elem(&sky_dispatch_map, &tid);
+	if (d) {
+		d->depth++;
+		return 0;
+	}
+
+	sky_service_key_t key = {
+		.pid = pid_tgid >> 32,
+	};
+	if (!bpf_map_lookup_elem(&proc_info_map, &key.pid))
+		return 0;
+
+	struct skynet_context *sctx = context;
+	if (bpf_probe_read_user(&key.handle, sizeof(key.handle), &sctx->handle) < 0 || key.handle == 0) {
+		return 0;
+	}
+	sky_dispatch_t item = {
+		.handle = key.handle,
+		.depth = 1,
+	};
+	bpf_map_update_elem(&sky_dispatch_map, &tid, &item, BPF_ANY);
+
+	u64 addr = (u64)context;
+	u64 *old = bpf_map_lookup_elem(&sky_service_map, &key);
+	if (!old || *old != addr) {
+		bpf_map_update_elem(&sky_service_map, &key, &addr, BPF_ANY);
+	}
+#endif
+	return 0;
+}
+
+SEC("uretprobe")
+int BPF_KRETPROBE(sky_dispatch_ret) {
+	u32 tid = (u32)bpf_get_current_pid_tgid();
+	sky_dispatch_t *d = bpf_map_lookup_elem(&sky_dispatch_map, &tid);
+	if (d && --d->depth == 0) {
+		bpf_map_delete_elem(&sky_dispatch_map, &tid);
+	}
 	return 0;
 }
@@ -12,6 +12,9 @@
 #include <sys/stat.h>
 #include <sys/resource.h>
 #include <signal.h>
+#include <getopt.h>
+#include <errno.h>
+#include <dirent.h>
 
 #include "stack.skel.h"
 #include "logger.h"
@@ -19,152 +22,772 @@
 #include "dwarfunwind.h"
 #include "common.h"
 #include "fgraph.h"
+#include "lualine.h"
+#include "unwindtable.h"
+#include "uprobes.h"
+#include "luasnap.h"
+#include "skynet.h"
 #include "asshelper.h"
+#include "trace_helpers.h"
 
 
 #define COLLECT_MAX_SIZE 2000
 #define PERF_FILE "perf.stack"
+#define WALL_PERIOD_NS (10 * 1000 * 1000) // on-cpu sample period of wall-clock mode
+#define DEFAULT_FREQ 99
+#define STAT_INTERVAL 10 // seconds between two health reports
+#define ALLOC_SAMPLE_BYTES (512 * 1024)
+#define AGG_ENTRIES 8192 // stack_agg_map size when it is drained every interval
+#define KEEP_AGG_ENTRIES 65536 // size when the stacks are kept until the end
 
 
 static volatile sig_atomic_t exiting = 0;
+static volatile sig_atomic_t report = 0; // SIGUSR1, write the live heap now
 
-static int stack_map_fd = -1;
-
-static VECTOR_TYPE(proc_stack_t) proclist;
+// stack_sample_t records stored back to back, see SAMPLE_SIZE
+static VECTOR_TYPE(char) proclist;
+static VECTOR_TYPE(char) proclist_old; // previous generation when proclist wraps
+static size_t proclist_count;
 static bool vec_cyc = false;
-static char procname[1024];
-
+static unwind_tables_t tables;
+static uprobes_t uprobes;
+
+// perf events of the cpu sampler, one per cpu or one per thread with -F
+typedef struct perf_item_t {
+	int fd;
+	struct bpf_link *link;
+} perf_item_t;
+
+static VECTOR_TYPE(perf_item_t) perf_events;
+
+// software events -e can sample
+typedef struct sw_event_t {
+	const char *name;
+	unsigned int config;
+} sw_event_t;
+
+static const sw_event_t sw_events[] = {
+	{ "cpu-clock", PERF_COUNT_SW_CPU_CLOCK },
+	{ "page-faults", PERF_COUNT_SW_PAGE_FAULTS },
+	{ "minor-faults", PERF_COUNT_SW_PAGE_FAULTS_MIN },
+	{ "major-faults", PERF_COUNT_SW_PAGE_FAULTS_MAJ },
+	{ "context-switches", PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ "cpu-migrations", PERF_COUNT_SW_CPU_MIGRATIONS },
+	{ "alignment-faults", PERF_COUNT_SW_ALIGNMENT_FAULTS },
+	{ "emulation-faults", PERF_COUNT_SW_EMULATION_FAULTS },
+};
+
+// a lua function given by -f, chunk is matched against the end of the chunk name
+typedef struct lat_func_t {
+	char chunk[STR_BUFFER_SIZE];
+	int linedefined;
+} lat_func_t;
+
+static struct env {
+	VECTOR_TYPE(int) pids;
+	const char *cgroup; // cgroup v2 directory, every lua process in it
+	bool all_lua; // every process that has luaV_execute
+	bool aggregate;
+	bool offcpu; // sample sched_switch instead of cpu clock, implies aggregate
+	bool wall; // cpu clock and sched_switch together, per thread in nanoseconds
+	const char *alloc_sym; // lua_Alloc to probe, stacks are weighted by allocated bytes
+	unsigned long long alloc_bytes; // one alloc sample every that many bytes
+	bool live; // alloc mode reports the bytes that are not freed yet
+	bool gc; // gc pause histograms, stacks of the long pauses by pause time
+	unsigned long long gc_min_us;
+	VECTOR_TYPE(lat_func_t) lat_funcs; // call latency of these functions
+	bool snapshot; // coroutine stacks of the lua states that run within interval
+	const char *service; // skynet service handle or name, the others are left out
+	int interval; // seconds between two drains of stack_agg_map
+	unsigned int agg_entries; // -A, stack_agg_map size, 0 picks one for the mode
+	int freq; // -F, samples per second of each thread's cpu time
+	const sw_event_t *event; // what the sampler counts
+} env = {
+	.interval = 1,
+	.alloc_bytes = ALLOC_SAMPLE_BYTES,
+	.event = &sw_events[0],
+};
+
+// the perf event sampler runs unless another mode replaces it
+static bool cpu_sampling(void) {
+	return env.wall || (!env.offcpu && !env.alloc_sym && !env.gc && !env.snapshot
+		&& VECTOR_GET_SIZE(lat_func_t, &env.lat_funcs) == 0);
+}
 
-int cmp_func(const void * a, const void * b) {
-	precomputed_unwind_t *unwinda = (precomputed_unwind_t *)a;
-	precomputed_unwind_t *unwindb = (precomputed_unwind_t *)b;
-	return (unwinda->ip > unwindb->ip) ? 1 : -1;
+// off-cpu and live heap stacks are charged after they are stored, so they
+// stay in stack_agg_map until the end
+static bool keep_stacks(void) {
+	return env.offcpu || env.live;
 }
 
-int update_bpf_maps(struct stack_bpf *obj, 
-			int pid, 
-			VECTOR_TYPE(precomputed_unwind_t) *precomputed_unwinds, 
-			luaV_execute_t *le) {
-    int size = VECTOR_GET_SIZE(precomputed_unwind_t, precomputed_unwinds);
+// sorted by hash, maps an aggregated stack to its record offset in proclist
+typedef struct stack_index_t {
+	unsigned long long hash;
+	size_t offset;
+} stack_index_t;
 
-	bpf_map__set_max_entries(obj->maps.fde_ip_map, size);
-	bpf_map__set_max_entries(obj->maps.fde_state_map, size);
+static VECTOR_TYPE(stack_index_t) stack_index;
+
+
+// size the unwind maps for every table, load the bpf object and upload the tables
+static int upload_unwind_tables(struct stack_bpf *obj, unwind_tables_t *t) {
+	int size = VECTOR_GET_SIZE(unwind_row_t, &t->rows);
+	int nstate = VECTOR_GET_SIZE(fde_state_t, &t->states);
+	int npage = VECTOR_GET_SIZE(page_item_t, &t->pages);
+	int nproc = VECTOR_GET_SIZE(proc_item_t, &t->procs);
+	int nmapping = VECTOR_GET_SIZE(proc_mapping_t, &t->mappings);
+	int err;
+
+	LOG(INFO, "processes: %d, mappings: %d, objects: %zu, unwind rows: %d, states: %d, pages: %d",
+		nproc, nmapping, VECTOR_GET_SIZE(object_item_t, &t->objects), size, nstate, npage);
+
+	bpf_map__set_max_entries(obj->maps.fde_ip_map, size > 0 ? size : 1);
+	bpf_map__set_max_entries(obj->maps.fde_state_map, nstate > 0 ? nstate : 1);
+	bpf_map__set_max_entries(obj->maps.fde_page_map, npage + 1);
+	bpf_map__set_max_entries(obj->maps.proc_info_map, nproc + 1);
+	bpf_map__set_max_entries(obj->maps.proc_mapping_map, nmapping > 0 ? nmapping : 1);
 	obj->bss->FDE_IP_COUNT = size;
-	obj->bss->target_pid = pid;
 
-	int err = stack_bpf__load(obj);
+	err = stack_bpf__load(obj);
 	if (err < 0) {
         return -1;
     }
 
-	qsort(precomputed_unwinds->vector, size, sizeof(precomputed_unwind_t), cmp_func);
-
-    unsigned int index = 0;
-    VECTOR_FOR_EACH_PTR(precomputed_unwind_t, u, precomputed_unwinds) {
-        int err = bpf_map__update_elem(obj->maps.fde_ip_map, &index, sizeof(index), &u->ip,
-			   sizeof(u->ip), BPF_ANY);
-        if (err < 0) {
-            LOG(ERROR, "Error updating map 1: %s\n", strerror(err));
-            return -1;
-        }
-
-        fde_state_t stateobj = {
-            .cfa_offset = u->state.cfa_offset, 
-            .cfa_register = u->state.cfa_register,
-			.cfa_expression = u->state.cfa_expression != NULL ? 1 : 0
-        };
-
-        for (int i = 0; i < DWARF_REGS; i++) {
-            stateobj.saved_registers[i].from = u->state.saved_registers[i].from;
-            stateobj.saved_registers[i].value = u->state.saved_registers[i].value;
-        }
-        err = bpf_map__update_elem(obj->maps.fde_state_map, &index, sizeof(index), &stateobj,
-			   sizeof(stateobj), BPF_ANY);
-        if (err < 0) {
-            LOG(ERROR, "Error updating map 2: %s\n", strerror(err));
-            return -1;
-        }
-
-        index ++;
-    }
+	VECTOR_FOR_EACH_PTR(page_item_t, p, &t->pages) {
+		err = bpf_map__update_elem(obj->maps.fde_page_map, &p->key, sizeof(p->key), &p->rows,
+			   sizeof(p->rows), BPF_ANY);
+		if (err < 0) {
+			LOG(ERROR, "Error updating page map: %s\n", strerror(-err));
+			return -1;
+		}
+	}
 
-	__u32 zero = 0;
-	bpf_map__update_elem(obj->maps.luaV_execute_map, &zero, sizeof(zero), le, sizeof(luaV_execute_t), BPF_ANY);
+	for (unsigned int index = 0; index < size; index++) {
+		err = bpf_map__update_elem(obj->maps.fde_ip_map, &index, sizeof(index),
+			   VECTOR_GET_PTR(unwind_row_t, &t->rows, index), sizeof(unwind_row_t), BPF_ANY);
+		if (err < 0) {
+			LOG(ERROR, "Error updating row map: %s\n", strerror(-err));
+			return -1;
+		}
+	}
+
+	for (unsigned int index = 0; index < nstate; index++) {
+		err = bpf_map__update_elem(obj->maps.fde_state_map, &index, sizeof(index),
+			   VECTOR_GET_PTR(fde_state_t, &t->states, index), sizeof(fde_state_t), BPF_ANY);
+		if (err < 0) {
+			LOG(ERROR, "Error updating state map: %s\n", strerror(-err));
+			return -1;
+		}
+	}
+
+	for (unsigned int index = 0; index < nmapping; index++) {
+		err = bpf_map__update_elem(obj->maps.proc_mapping_map, &index, sizeof(index),
+			   VECTOR_GET_PTR(proc_mapping_t, &t->mappings, index), sizeof(proc_mapping_t), BPF_ANY);
+		if (err < 0) {
+			LOG(ERROR, "Error updating mapping map: %s\n", strerror(-err));
+			return -1;
+		}
+	}
+
+	// adding the process last turns sampling on for it
+	VECTOR_FOR_EACH_PTR(proc_item_t, p, &t->procs) {
+		__u32 pid = p->pid;
+		err = bpf_map__update_elem(obj->maps.proc_info_map, &pid, sizeof(pid), &p->info,
+			   sizeof(p->info), BPF_ANY);
+		if (err < 0) {
+			LOG(ERROR, "Error updating proc map: %s\n", strerror(-err));
+			return -1;
+		}
+	}
 	return 0;
 }
 
-int unwind_init(struct stack_bpf *obj, int pid) {
-	int err;
-	const Elf64_Sym *lsym;
-    running_maps_t *maps;
-    dwarf_unwind_info_t dinfo;
-
-	// find luaV_execute address and lua_State
-	unsigned long addr_ori = 0;
-	unsigned long addr_start = 0;
-	unsigned long addr_end = 0;
-	param_t l;
-
-	maps = create_maps(pid);
-    if (maps == NULL) {
-        return -1;
-    }
+// fill tables with the processes selected on the command line
+static int load_targets(unwind_tables_t *t) {
+	VECTOR_FOR_EACH_PTR(int, pid, &env.pids) {
+		if (unwind_tables_add(t, *pid, 0) < 0) {
+			LOG(ERROR, "load pid %d failed", *pid);
+			return -1;
+		}
+	}
 
-    LOG(INFO, "pid: %d\n", pid);
+	if (env.cgroup) {
+		char path[512];
+		char line[32];
+		snprintf(path, sizeof(path), "%s/cgroup.procs", env.cgroup);
+		FILE *f = fopen(path, "r");
+		if (f == NULL) {
+			LOG(ERROR, "cannot open %s: %s", path, strerror(errno));
+			return -1;
+		}
+		while (fgets(line, sizeof(line), f)) {
+			int pid = atoi(line);
+			if (pid > 0 && unwind_tables_add(t, pid, 1) < 0) {
+				LOG(WARN, "skip pid %d", pid);
+			}
+		}
+		fclose(f);
+	}
 
-    memset(&dinfo, 0, sizeof(dinfo));
+	if (env.all_lua) {
+		DIR *dir = opendir("/proc");
+		struct dirent *ent;
+		if (dir == NULL) {
+			LOG(ERROR, "cannot open /proc: %s", strerror(errno));
+			return -1;
+		}
+		while ((ent = readdir(dir)) != NULL) {
+			int pid = atoi(ent->d_name);
+			if (pid > 0 && pid != getpid() && unwind_tables_add(t, pid, 1) < 0) {
+				LOG(WARN, "skip pid %d", pid);
+			}
+		}
+		closedir(dir);
+	}
 
-    init_dwarf_unwind_info(&dinfo);
+	if (VECTOR_GET_SIZE(proc_item_t, &t->procs) == 0) {
+		LOG(ERROR, "no process to profile");
+		return -1;
+	}
+	return 0;
+}
 
-    for (int i = 0; i < maps->count; i++) {
-        map_item_t *item = &maps->item[i];
-        LOG(INFO, "---> %s (%lx-%lx  %lx)", item->path, item->addr_start, item->addr_end, item->addr_offset);
-        dinfo.item = item;
-        load_dwarf_unwind_information(&dinfo);
+static const char *proc_name(int pid) {
+	return unwind_tables_proc_name(&tables, pid);
+}
 
-		if (i == 0) {
-			snprintf(procname, sizeof(procname), "%s", item->path);
+// bpf only records the pc, look the lines up while the Protos are still alive
+static void resolve_lines(stack_sample_t *s) {
+	lua_func_t *lstack = SAMPLE_LSTACK(s);
+	for (int i = 0; i < s->lstack_sz; i++) {
+		if (lstack[i].flag >= 0) {
+			lstack[i].currline = lualine_resolve(s->pid, lstack[i].proto,
+				lstack[i].startline, lstack[i].endline, lstack[i].pc);
 		}
+	}
+}
 
-		if (addr_start == 0) {
-			lsym = find_symname_address(&item->elf, "luaV_execute");
-			if (lsym) {
-				addr_ori = lsym->st_value;
-				addr_start = addr_ori + item->addr_start - item->addr_offset;
+static void append_sample(const stack_sample_t *s) {
+	VECTOR_APPEND(char, &proclist, s, SAMPLE_SIZE(s));
+	proclist_count++;
+}
 
-				err = find_func_reg1(item->elf.map, addr_ori, lsym->st_size, &l);
-			    if (!err) {
-					LOG(INFO, "find luaV_execute param, type: %d, reg: %u, offset: %d", l.type, l.reg, l.offset);
-				}
-			}
+static void push_sample(const stack_sample_t *s) {
+	size_t off = VECTOR_GET_SIZE(char, &proclist);
+	append_sample(s);
+	// s may point into the read-only ring buffer, so patch the copy
+	resolve_lines((stack_sample_t *)VECTOR_GET_PTR(char, &proclist, off));
+}
+
+// pack a fixed size proc_stack_t from stack_agg_map into a sample record
+static void pack_stack(const proc_stack_t *stk, stack_sample_t *s) {
+	memset(s, 0, sizeof(*s));
+	s->pid = stk->pid;
+	s->tid = stk->tid;
+	s->state = stk->state;
+	s->service = stk->service;
+	s->weight = stk->weight;
+	s->kstack_sz = stk->kstack_sz;
+	s->ustack_sz = stk->ustack_sz;
+	s->lstack_sz = stk->lstack_sz;
+
+	memcpy(SAMPLE_KSTACK(s), stk->kstack, s->kstack_sz * sizeof(unsigned long long));
+	memcpy(SAMPLE_USTACK(s), stk->ustack, s->ustack_sz * sizeof(unsigned long long));
+	memcpy(SAMPLE_LSTACK(s), stk->lstack, s->lstack_sz * sizeof(lua_func_t));
+}
+
+static unsigned long long hash_u64(unsigned long long hash, unsigned long long value) {
+	return (hash ^ value) * STACK_HASH_PRIME;
+}
+
+// like hash_stack in bpf, but with the resolved line of a lua frame in place of
+// its pc, so the pcs of one line end up in one record
+static unsigned long long hash_sample(const stack_sample_t *s) {
+	unsigned long long hash = hash_u64(hash_u64(hash_u64(STACK_HASH_SEED, s->pid),
+		((unsigned long long)s->tid << 32) | s->state), s->service);
+
+	const unsigned long long *ustack = SAMPLE_USTACK(s);
+	for (int i = 0; i < s->ustack_sz && i < MAX_UNWIND_DEEP; i++) {
+		hash = hash_u64(hash, ustack[i]);
+	}
+	hash = hash_u64(hash, s->ustack_sz);
+
+	const lua_func_t *lstack = SAMPLE_LSTACK(s);
+	for (int i = 0; i < s->lstack_sz && i < MAX_UNWIND_DEEP; i++) {
+		hash = hash_u64(hash, ((unsigned long long)lstack[i].lv_idx << 32) | (unsigned int)lstack[i].flag);
+		if (lstack[i].flag >= 0) {
+			hash = hash_u64(hash, lstack[i].source);
+			hash = hash_u64(hash, ((unsigned long long)lstack[i].startline << 32) | (unsigned int)lstack[i].endline);
+			hash = hash_u64(hash, (unsigned int)lstack[i].currline);
 		}
-    }
+	}
+	return hash_u64(hash, s->lstack_sz);
+}
 
-	VECTOR_FOR_EACH_PTR(dwarf_unwind_region_t, u, &dinfo.regions) {
-		if (!err && addr_start > 0) {
-			if (addr_ori == u->base) {
-				addr_end = addr_start + u->length;
-			}
+// a hash match is only a hint, two records are one stack when every field the
+// hash covers is equal. the kernel stack and the pc of a lua frame are not part
+// of it, only its line is, the record keeps those of its first sample
+static bool same_stack(const stack_sample_t *a, const stack_sample_t *b) {
+	if (a->pid != b->pid || a->tid != b->tid || a->state != b->state || a->service != b->service
+			|| a->ustack_sz != b->ustack_sz || a->lstack_sz != b->lstack_sz) {
+		return false;
+	}
+	if (memcmp(SAMPLE_USTACK(a), SAMPLE_USTACK(b), a->ustack_sz * sizeof(unsigned long long)) != 0) {
+		return false;
+	}
+
+	const lua_func_t *la = SAMPLE_LSTACK(a), *lb = SAMPLE_LSTACK(b);
+	for (int i = 0; i < a->lstack_sz; i++) {
+		if (la[i].lv_idx != lb[i].lv_idx || la[i].flag != lb[i].flag) {
+			return false;
+		}
+		if (la[i].flag >= 0 && (la[i].source != lb[i].source
+				|| la[i].startline != lb[i].startline || la[i].endline != lb[i].endline
+				|| la[i].currline != lb[i].currline)) {
+			return false;
 		}
+	}
+	return true;
+}
 
-		free(u->unwind_data);
+// fold s into the record of the same stack, s is scratch and gets its lines
+static void merge_stack(stack_sample_t *s) {
+	resolve_lines(s);
+	unsigned long long hash = hash_sample(s);
+	size_t sz = VECTOR_GET_SIZE(stack_index_t, &stack_index);
+	size_t lo = 0, hi = sz;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (VECTOR_GET(stack_index_t, &stack_index, mid).hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
 
-	LOG(INFO, "=== luaV_execute %lx <%lx-%lx>\n", addr_ori, addr_start, addr_end);
+	// colliding stacks sit next to each other under one hash
+	for (size_t i = lo; i < sz && VECTOR_GET(stack_index_t, &stack_index, i).hash == hash; i++) {
+		size_t offset = VECTOR_GET(stack_index_t, &stack_index, i).offset;
+		stack_sample_t *old = (stack_sample_t *)VECTOR_GET_PTR(char, &proclist, offset);
+		if (same_stack(old, s)) {
+			old->weight += s->weight;
+			return;
+		}
+	}
 
-	luaV_execute_t lt = {
-		.ip_start = addr_start, 
-		.ip_end = addr_end, 
-		.lstate = l,
+	stack_index_t item = {
+		.hash = hash,
+		.offset = VECTOR_GET_SIZE(char, &proclist),
 	};
-    err = update_bpf_maps(obj, pid, &dinfo.precomputed_unwinds, &lt);
+	append_sample(s);
+
+	VECTOR_PUSH(stack_index_t, &stack_index, item);
+	stack_index_t *data = VECTOR_DATA(stack_index_t, &stack_index);
+	memmove(data + lo + 1, data + lo, (sz - lo) * sizeof(stack_index_t));
+	data[lo] = item;
+}
+
+// move everything aggregated in kernel since the last drain into proclist,
+// remove is false for a snapshot that leaves the map as it is
+static void drain_stack_agg(struct stack_bpf *obj, bool remove) {
+	int fd = bpf_map__fd(obj->maps.stack_agg_map);
+	VECTOR_TYPE(unsigned long long) keys;
+	unsigned long long key, next;
+	proc_stack_t stk;
+	unsigned long long buf[SAMPLE_MAX_SIZE / sizeof(unsigned long long)];
+	stack_sample_t *s = (stack_sample_t *)buf;
+	int err;
+
+	VECTOR_INIT(unsigned long long, &keys);
+	for (err = bpf_map_get_next_key(fd, NULL, &next); !err;
+			err = bpf_map_get_next_key(fd, &key, &next)) {
+		VECTOR_PUSH(unsigned long long, &keys, next);
+		key = next;
+	}
+
+	VECTOR_FOR_EACH_PTR(unsigned long long, k, &keys) {
+		err = remove ? bpf_map_lookup_and_delete_elem(fd, k, &stk) : bpf_map_lookup_elem(fd, k, &stk);
+		// stacks that were never charged or whose blocks are all freed
+		if (!err && (long long)stk.weight > 0) {
+			pack_stack(&stk, s);
+			merge_stack(s);
+		}
+	}
+
+	VECTOR_FREE(unsigned long long, &keys);
+}
+
+// threads still blocked at exit have not been charged yet, add their time
+// so far before the last drain
+static void charge_offcpu_pending(struct stack_bpf *obj) {
+	int fd = bpf_map__fd(obj->maps.offcpu_start_map);
+	int agg_fd = bpf_map__fd(obj->maps.stack_agg_map);
+	unsigned long long now = get_ktime_ns();
+	__u32 key, next;
+	offcpu_start_t start;
+	proc_stack_t stk;
+	int err;
+
+	for (err = bpf_map_get_next_key(fd, NULL, &next); !err;
+			err = bpf_map_get_next_key(fd, &key, &next)) {
+		key = next;
+		if (bpf_map_lookup_elem(fd, &key, &start) || now <= start.ts) {
+			continue;
+		}
+		if (!bpf_map_lookup_elem(agg_fd, &start.hash, &stk)) {
+			stk.weight += now - start.ts;
+			bpf_map_update_elem(agg_fd, &start.hash, &stk, BPF_EXIST);
+		}
+	}
+}
+
+static int sky_service_fd = -1;
+
+static bool match_service(unsigned int handle, const char *name) {
+	const char *sel = env.service;
+	char *end;
+	unsigned long h = *sel == ':' ? strtoul(sel + 1, &end, 16) : strtoul(sel, &end, 0);
+	if (end != sel && *end == '\0') {
+		return h == handle;
+	}
+	return name && strcmp(name, sel) == 0;
+}
+
+// root frame of the skynet service a sample was taken in
+static const char *service_label(const stack_sample_t *s) {
+	static char label[96];
+	if (s->service == 0) {
+		return env.service ? NULL : "";
+	}
+
+	sky_service_key_t key = {
+		.pid = s->pid,
+		.handle = s->service,
+	};
+	unsigned long long ctx = 0;
+	bpf_map_lookup_elem(sky_service_fd, &key, &ctx);
+	const char *name = skynet_service_name(s->pid, s->service, ctx);
+	if (env.service && !match_service(s->service, name)) {
+		return NULL;
+	}
+	snprintf(label, sizeof(label), ":%08x %s", s->service, name ? name : "?");
+	return label;
+}
+
+static void write_perf_file(struct stack_bpf *obj) {
+	LOG(INFO, "write file: %s ...", PERF_FILE);
+	fgraph_init(PERF_FILE);
+	fgraph_load_sources(bpf_map__fd(obj->maps.lua_name_map), obj->bss->lua_source_count);
+	sky_service_fd = bpf_map__fd(obj->maps.sky_service_map);
+	fgraph_output(&proclist, proc_name, service_label);
+	fgraph_free();
+	LOG(INFO, "write %s file end\n", PERF_FILE);
+}
+
+// live heap: write the outstanding bytes by allocating stack, the map is kept
+static void report_live_heap(struct stack_bpf *obj) {
+	VECTOR_CLEAR(char, &proclist);
+	VECTOR_CLEAR(stack_index_t, &stack_index);
+	proclist_count = 0;
+	drain_stack_agg(obj, false);
+	write_perf_file(obj);
+}
+
+// the gc entry points, they nest and only the outermost call is timed
+static const char *gc_syms[] = {
+	"luaC_step",
+	"luaC_fullgc",
+#if (defined LUA54 || defined LUASKY)
+	"youngcollection",
+	"fullgen",
+#endif
+};
+
+static int attach_gc_probes(struct stack_bpf *obj) {
+	int count = 0;
+	for (int i = 0; i < sizeof(gc_syms) / sizeof(gc_syms[0]); i++) {
+		int n = uprobes_attach(&uprobes, obj->progs.gc_enter, false, &tables, gc_syms[i]);
+		if (n > 0 && uprobes_attach(&uprobes, obj->progs.gc_exit, true, &tables, gc_syms[i]) != n) {
+			LOG(ERROR, "attach the return of %s failed", gc_syms[i]);
+			return -1;
+		}
+		if (n == 0) {
+			LOG(WARN, "%s not found, maybe inlined", gc_syms[i]);
+		}
+		count += n;
+	}
+	return count;
+}
+
+static void print_gc_hist(struct stack_bpf *obj) {
+	int fd = bpf_map__fd(obj->maps.gc_hist_map);
+	__u32 key, next;
+	hist_t hist;
+	int err;
+
+	for (err = bpf_map_get_next_key(fd, NULL, &next); !err;
+			err = bpf_map_get_next_key(fd, &key, &next)) {
+		key = next;
+		if (bpf_map_lookup_elem(fd, &key, &hist) || hist.count == 0) {
+			continue;
+		}
+		printf("\npid %u %s: %llu gc pauses, total %.3f ms, avg %llu us, max %llu us\n",
+			key, proc_name(key), hist.count, hist.total_ns / 1e6,
+			hist.total_ns / hist.count / 1000, hist.max_ns / 1000);
+		print_log2_hist(hist.slots, HIST_SLOTS, "usecs");
+	}
+}
+
+#ifdef LUASKY
+// skynet: dispatch_message of skynet_server.c gets the context of every
+// service, c ones too, unless it was inlined. the snlua message callbacks
+// cover the lua services then. all static, so only looked up in their module
+static const struct {
+	const char *sym;
+	const char *file;
+} sky_callbacks[] = {
+	{ "dispatch_message", "skynet" },
+	{ "launch_cb", "snlua.so" },
+	{ "_cb", "skynet.so" },
+	{ "forward_cb", "skynet.so" },
+};
+
+static int attach_sky_probes(struct stack_bpf *obj) {
+	int count = 0;
+	for (int i = 0; i < sizeof(sky_callbacks) / sizeof(sky_callbacks[0]); i++) {
+		const char *sym = sky_callbacks[i].sym;
+		const char *file = sky_callbacks[i].file;
+		int n = uprobes_attach_file(&uprobes, obj->progs.sky_dispatch, false, &tables, sym, file);
+		if (n > 0 && uprobes_attach_file(&uprobes, obj->progs.sky_dispatch_ret, true, &tables, sym, file) != n) {
+			LOG(ERROR, "attach the return of %s failed", sym);
+			return -1;
+		}
+		if (i == 0 && n == 0) {
+			LOG(WARN, "no dispatch_message in skynet, only lua services are tagged");
+		}
+		count += n;
+	}
+	return count;
+}
+#endif
+
+static int attach_lat_probes(struct stack_bpf *obj) {
+	if (uprobes_attach(&uprobes, obj->progs.lat_precall, false, &tables, "luaD_precall") == 0
+			|| uprobes_attach(&uprobes, obj->progs.lat_precall_ret, true, &tables, "luaD_precall") == 0
+			|| uprobes_attach(&uprobes, obj->progs.lat_poscall, false, &tables, "luaD_poscall") == 0) {
+		return -1;
+	}
+#if (defined LUA54 || defined LUASKY)
+	if (uprobes_attach(&uprobes, obj->progs.lat_execute, false, &tables, "luaV_execute") == 0
+			|| uprobes_attach(&uprobes, obj->progs.lat_execute_ret, true, &tables, "luaV_execute") == 0) {
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+static int match_chunk(const char *name, const char *chunk) {
+	size_t n = strlen(name), c = strlen(chunk);
+	return n >= c && strcmp(name + n - c, chunk) == 0;
+}
+
+// chunk names are interned in bpf as functions are called, select the -f
+// functions once their chunk has an id
+// ids whose name was not written yet when they were looked at
+static VECTOR_TYPE(unsigned int) lat_pending;
+
+// return 0 when the name of id is known and the -f functions in it are selected
+static int select_lat_source(int name_fd, int filter_fd, unsigned int id) {
+	lua_source_t src;
+	__u8 on = 1;
+
+	// the id is taken a moment before the name is copied in
+	if (bpf_map_lookup_elem(name_fd, &id, &src) || src.name[0] == '\0') {
+		return -1;
+	}
+	src.name[sizeof(src.name) - 1] = '\0';
+
+	VECTOR_FOR_EACH_PTR(lat_func_t, f, &env.lat_funcs) {
+		if (!match_chunk(src.name, f->chunk)) {
+			continue;
+		}
+		lat_filter_key_t key = {
+			.source = id,
+			.linedefined = f->linedefined,
+		};
+		bpf_map_update_elem(filter_fd, &key, &on, BPF_ANY);
+		LOG(INFO, "time %s:%d", src.name, f->linedefined);
+	}
+	return 0;
+}
+
+static void update_lat_filter(struct stack_bpf *obj) {
+	static unsigned int next_id = 1;
+	int name_fd = bpf_map__fd(obj->maps.lua_name_map);
+	int filter_fd = bpf_map__fd(obj->maps.lat_filter_map);
+	unsigned int count = obj->bss->lua_source_count;
+
+	// an empty slot does not hold up the ids after it, it is retried next time
+	size_t n = VECTOR_GET_SIZE(unsigned int, &lat_pending);
+	VECTOR_CLEAR(unsigned int, &lat_pending);
+	for (size_t i = 0; i < n; i++) {
+		unsigned int id = VECTOR_GET(unsigned int, &lat_pending, i);
+		if (select_lat_source(name_fd, filter_fd, id) < 0) {
+			VECTOR_PUSH(unsigned int, &lat_pending, id);
+		}
+	}
+
+	for (; next_id <= count && next_id < MAX_LUA_SOURCES; next_id++) {
+		if (select_lat_source(name_fd, filter_fd, next_id) < 0) {
+			VECTOR_PUSH(unsigned int, &lat_pending, next_id);
+		}
+	}
+}
+
+static void print_lat_hist(struct stack_bpf *obj) {
+	int fd = bpf_map__fd(obj->maps.func_hist_map);
+	int name_fd = bpf_map__fd(obj->maps.lua_name_map);
+	func_hist_key_t key, next;
+	func_hist_t fh;
+	lua_source_t src;
+	int err;
+
+	for (err = bpf_map_get_next_key(fd, NULL, &next); !err;
+			err = bpf_map_get_next_key(fd, &key, &next)) {
+		key = next;
+		if (bpf_map_lookup_elem(fd, &key, &fh) || fh.hist.count == 0) {
+			continue;
+		}
+		if (bpf_map_lookup_elem(name_fd, &fh.source, &src)) {
+			src.name[0] = '\0';
+		}
+		src.name[sizeof(src.name) - 1] = '\0';
+		printf("\n%s:%d pid %u %s: %llu calls, avg %llu us, max %llu us\n",
+			src.name, fh.linedefined, key.pid, proc_name(key.pid), fh.hist.count,
+			fh.hist.total_ns / fh.hist.count / 1000, fh.hist.max_ns / 1000);
+		print_log2_hist(fh.hist.slots, HIST_SLOTS, "usecs");
+	}
+}
 
-    free_maps(maps);
+static int cmp_global_key(const void *a, const void *b) {
+	const lua_global_key_t *x = a, *y = b;
+	if (x->pid != y->pid) {
+		return x->pid < y->pid ? -1 : 1;
+	}
+	return x->g < y->g ? -1 : x->g > y->g;
+}
 
-	VECTOR_FREE(precomputed_unwind_t, &dinfo.precomputed_unwinds);
-	VECTOR_FREE(dwarf_unwind_region_t, &dinfo.regions);
+// walk every global_State snap_state has seen, one report per process
+static void print_snapshot(struct stack_bpf *obj) {
+	int fd = bpf_map__fd(obj->maps.lua_global_map);
+	VECTOR_TYPE(lua_global_key_t) keys;
+	lua_global_key_t key, next;
+	int err;
 
-	return err;
+	VECTOR_INIT(lua_global_key_t, &keys);
+	for (err = bpf_map_get_next_key(fd, NULL, &next); !err;
+			err = bpf_map_get_next_key(fd, &key, &next)) {
+		key = next;
+		VECTOR_PUSH(lua_global_key_t, &keys, key);
+	}
+	size_t ran = VECTOR_GET_SIZE(lua_global_key_t, &keys);
+
+	// skynet keeps every service in its handle storage, the idle ones are
+	// taken from there. other states are only known once they ran lua
+	VECTOR_TYPE(unsigned long long) globals;
+	VECTOR_INIT(unsigned long long, &globals);
+	VECTOR_FOR_EACH_PTR(proc_item_t, p, &tables.procs) {
+		VECTOR_CLEAR(unsigned long long, &globals);
+		if (skynet_lua_globals(p->pid, &globals) < 0) {
+			LOG(WARN, "pid %d: only the lua states that ran in %d seconds are walked",
+				p->pid, env.interval);
+			continue;
+		}
+		VECTOR_FOR_EACH_PTR(unsigned long long, g, &globals) {
+			lua_global_key_t item = { .pid = p->pid, .g = *g };
+			VECTOR_PUSH(lua_global_key_t, &keys, item);
+		}
+	}
+	VECTOR_FREE(unsigned long long, &globals);
+
+	size_t n = VECTOR_GET_SIZE(lua_global_key_t, &keys);
+	qsort(VECTOR_DATA(lua_global_key_t, &keys), n, sizeof(lua_global_key_t), cmp_global_key);
+	lua_global_key_t *data = VECTOR_DATA(lua_global_key_t, &keys);
+	size_t uniq = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (uniq == 0 || cmp_global_key(&data[uniq - 1], &data[i]) != 0) {
+			data[uniq++] = data[i];
+		}
+	}
+	if (uniq > ran) {
+		LOG(INFO, "%zu idle skynet services added to the %zu lua states that ran", uniq - ran, ran);
+	}
+	n = uniq;
+
+	for (size_t i = 0; i < n;) {
+		luasnap_t snap;
+		int pid = VECTOR_GET_PTR(lua_global_key_t, &keys, i)->pid;
+		luasnap_init(&snap, pid);
+		for (; i < n && VECTOR_GET_PTR(lua_global_key_t, &keys, i)->pid == pid; i++) {
+			luasnap_walk(&snap, VECTOR_GET_PTR(lua_global_key_t, &keys, i)->g);
+		}
+		luasnap_print(&snap, proc_name(pid));
+		luasnap_free(&snap);
+	}
+	if (n == 0) {
+		LOG(WARN, "no lua state found in %d seconds", env.interval);
+	}
+	VECTOR_FREE(lua_global_key_t, &keys);
+}
+
+static const char *stat_names[STAT_MAX] = {
+	[STAT_SAMPLES] = "samples",
+	[STAT_LUA_COMPLETE] = "complete lua",
+	[STAT_RINGBUF_DROP] = "ringbuf drop",
+	[STAT_AGG_FULL] = "agg map full",
+	[STAT_AGG_DROP] = "agg map full, dropped",
+	[STAT_REGS_FAIL] = "regs fail",
+	[STAT_MAPPING_MISS] = "mapping miss",
+	[STAT_ROW_MISS] = "unwind row miss",
+	[STAT_NATIVE_READ] = "native read fail",
+	[STAT_NATIVE_TRUNC] = "native truncated",
+	[STAT_LUA_MISS] = "no lua frame",
+	[STAT_LUA_READ] = "lua read fail",
+	[STAT_LUA_ABORT] = "lua abort",
+	[STAT_LUA_TRUNC] = "lua truncated",
+	[STAT_LIVE_UNTRACKED] = "live untracked",
+};
+
+// sum the per-cpu counters of stat_map and log the ones that are set
+static void print_stats(struct stack_bpf *obj, int num_cpus) {
+	int fd = bpf_map__fd(obj->maps.stat_map);
+	unsigned long long total[STAT_MAX] = {};
+	unsigned long long *values = calloc(num_cpus, sizeof(unsigned long long));
+	char buf[1024];
+	int sz = 0;
+
+	if (values == NULL) {
+		return;
+	}
+	for (__u32 i = 0; i < STAT_MAX; i++) {
+		if (bpf_map_lookup_elem(fd, &i, values)) {
+			continue;
+		}
+		for (int cpu = 0; cpu < num_cpus; cpu++) {
+			total[i] += values[cpu];
+		}
+	}
+	free(values);
+
+	unsigned long long samples = total[STAT_SAMPLES];
+	sz += snprintf(buf + sz, sizeof(buf) - sz, "samples: %llu, complete lua stacks: %.1f%%",
+		samples, samples ? total[STAT_LUA_COMPLETE] * 100.0 / samples : 0.0);
+	for (int i = STAT_RINGBUF_DROP; i < STAT_MAX && sz < sizeof(buf); i++) {
+		if (total[i]) {
+			sz += snprintf(buf + sz, sizeof(buf) - sz, ", %s: %llu", stat_names[i], total[i]);
+		}
+	}
+	LOG(INFO, "%s", buf);
 }
 
 static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args) {
@@ -181,22 +804,36 @@ static long perf_event_open(struct perf_event_attr *hw_event, pid_t pid, int cpu
 
 /* Receive events from the ring buffer. */
 static int event_handler(void *_ctx, void *data, size_t size) {
-	struct stacktrace_event_t *event = data;
-	proc_stack_t stk;
-	if (bpf_map_lookup_elem(stack_map_fd, &event->stack_map_idx, &stk) < 0) {
+	stack_sample_t *s = data;
+	if (size < sizeof(*s) || size < SAMPLE_SIZE(s)) {
 		return 1;
 	}
 
-	if (stk.ustack_sz <= 0 || exiting)
+	if (s->ustack_sz <= 0 || exiting)
 		return 1;
 
-	size_t sz = VECTOR_GET_SIZE(proc_stack_t, &proclist);
-	if (sz > COLLECT_MAX_SIZE) {
+	// keep the latest COLLECT_MAX_SIZE to 2 * COLLECT_MAX_SIZE samples
+	if (!env.aggregate && proclist_count > COLLECT_MAX_SIZE) {
 		vec_cyc = true;
-		VECTOR_RESIZE(proc_stack_t, &proclist, 0);
+		VECTOR_TYPE(char) tmp = proclist_old;
+		proclist_old = proclist;
+		proclist = tmp;
+		VECTOR_CLEAR(char, &proclist);
+		proclist_count = 0;
 	}
 
-	VECTOR_PUSH(proc_stack_t, &proclist, stk);
+	// stacks that did not fit in stack_agg_map fold into proclist here, so
+	// a full map does not grow it by one record per sample
+	if (env.aggregate) {
+		static unsigned long long buf[SAMPLE_DEEP_SIZE / sizeof(unsigned long long)];
+		if (SAMPLE_SIZE(s) > sizeof(buf)) {
+			return 1;
+		}
+		memcpy(buf, s, SAMPLE_SIZE(s));
+		merge_stack((stack_sample_t *)buf);
+	} else {
+		push_sample(s);
+	}
 
 	if (exiting) {
 		return -1;
@@ -205,31 +842,73 @@ static int event_handler(void *_ctx, void *data, size_t size) {
     return 0;
 }
 
-static int start_profile(struct stack_bpf *obj, int *pefds, struct bpf_link **links, int num_cpus) {
-	int pefd;
-	struct perf_event_attr attr;
-	memset(&attr, 0, sizeof(attr));
-	attr.type = PERF_TYPE_SOFTWARE;
-	attr.size = sizeof(attr);
-	attr.config = PERF_COUNT_SW_CPU_CLOCK;
-	attr.sample_freq = 100; // 1 second frequency
-	// attr.freq = 1;
+// returns -1 when the event can not be opened, -2 when attaching fails
+static int open_perf_event(struct stack_bpf *obj, struct perf_event_attr *attr, int pid, int cpu) {
+	perf_item_t item;
+	item.fd = perf_event_open(attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+	if (item.fd < 0) {
+		return -1;
+	}
 
-	for (int cpu = 0; cpu < num_cpus; cpu++) {
-		if (cpu >= 256)
-			continue;
+	item.link = bpf_program__attach_perf_event(obj->progs.profile, item.fd);
+	VECTOR_PUSH(perf_item_t, &perf_events, item);
+	return item.link ? 0 : -2;
+}
 
-		pefd = perf_event_open(&attr, -1, cpu, -1, PERF_FLAG_FD_CLOEXEC);
-		if (pefd < 0) {
-			pefds[cpu] = -1;
+// one event per thread, so every thread gets the same share of samples per
+// second of its cpu time. threads started later by them inherit the event
+static int start_thread_profile(struct stack_bpf *obj, struct perf_event_attr *attr) {
+	char path[64];
+	struct dirent *ent;
+
+	attr->inherit = 1;
+	VECTOR_FOR_EACH_PTR(proc_item_t, p, &tables.procs) {
+		snprintf(path, sizeof(path), "/proc/%d/task", p->pid);
+		DIR *dir = opendir(path);
+		if (dir == NULL) {
+			LOG(WARN, "cannot open %s: %s", path, strerror(errno));
 			continue;
 		}
+		while ((ent = readdir(dir)) != NULL) {
+			int tid = atoi(ent->d_name);
+			// a thread may exit while we go through the list
+			if (tid > 0 && open_perf_event(obj, attr, tid, -1) == -2) {
+				closedir(dir);
+				return -1;
+			}
+		}
+		closedir(dir);
+	}
+	LOG(INFO, "sampling %s of %zu threads at %d Hz", env.event->name,
+		VECTOR_GET_SIZE(perf_item_t, &perf_events), env.freq);
+	return 0;
+}
+
+static int start_profile(struct stack_bpf *obj, int num_cpus) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_SOFTWARE;
+	attr.size = sizeof(attr);
+	attr.config = env.event->config;
+	attr.freq = 1;
+	attr.sample_freq = env.freq ? env.freq : DEFAULT_FREQ;
+	// other events are rare next to the clock, take every one unless -F
+	if (env.event->config != PERF_COUNT_SW_CPU_CLOCK && !env.freq) {
+		attr.freq = 0;
+		attr.sample_period = 1;
+	}
+	if (env.wall) {
+		attr.freq = 0;
+		attr.sample_period = WALL_PERIOD_NS;
+	}
 
-		pefds[cpu] = pefd;
+	if (env.freq && !env.wall) {
+		return start_thread_profile(obj, &attr);
+	}
 
+	for (int cpu = 0; cpu < num_cpus; cpu++) {
 		/* Attach a BPF program on a CPU */
-		links[cpu] = bpf_program__attach_perf_event(obj->progs.profile, pefd);
-		if (!links[cpu]) {
+		if (open_perf_event(obj, &attr, -1, cpu) == -2) {
 			return -1;
 		}
 	}
@@ -241,35 +920,199 @@ static void sig_handler(int sig) {
 	exiting = 1;
 }
 
-int main(int argc, char const *argv[]) {
-    if (argc != 2) {
-        LOG(INFO, "Need Process PID to trace\n");
-        return -1;
-    }
+static void report_handler(int sig) {
+	report = 1;
+}
+
+static void usage(const char *prog) {
+	LOG(INFO, "Usage: %s [-a] [-o] [-w] [-m alloc [-b bytes] [-l]] [-G usec] [-f chunk:line ...] [-F hz] [-e event] [-S] [-s service] [-A entries] [-i interval] [-c cgroup] [-L] [pid ...]", prog);
+	LOG(INFO, "  -a           aggregate identical stacks in kernel");
+	LOG(INFO, "  -o           off-cpu profile, stacks are weighted by blocked nanoseconds");
+	LOG(INFO, "  -w           wall-clock profile per thread, on and off cpu time in nanoseconds");
+	LOG(INFO, "  -m alloc     allocation profile, uprobe the lua_Alloc function (l_alloc, lalloc)");
+	LOG(INFO, "  -b bytes     take one allocation stack every that many bytes (default %d)", ALLOC_SAMPLE_BYTES);
+	LOG(INFO, "  -l           with -m, live heap by allocating stack, SIGUSR1 writes a report");
+	LOG(INFO, "  -G usec      gc pause histograms, stacks of pauses at least usec long");
+	LOG(INFO, "  -F hz        sample each thread hz times per second of its cpu time,");
+	LOG(INFO, "               default %d Hz on every cpu", DEFAULT_FREQ);
+	LOG(INFO, "  -e event     cpu-clock (default), page-faults, minor-faults, major-faults,");
+	LOG(INFO, "               context-switches, cpu-migrations, alignment-faults, emulation-faults");
+	LOG(INFO, "  -f chunk:line  call latency histogram of the lua function defined there, repeatable");
+#if (defined LUA54 || defined LUASKY)
+	LOG(INFO, "               lua to lua calls that return 0 or 1 values are not timed");
+#endif
+	LOG(INFO, "  -S           coroutine stacks of the lua states that run within interval,");
+	LOG(INFO, "               grouped by identical stack");
+	LOG(INFO, "  -s service   skynet build, only the stacks of this service handle (:0000000a) or name");
+	LOG(INFO, "  -c cgroup    profile the lua processes of a cgroup v2 directory");
+	LOG(INFO, "  -L           profile every lua process");
+	LOG(INFO, "  -A entries   unique stacks kept in kernel (default %d, %d for -o, -w and -l)",
+		AGG_ENTRIES, KEEP_AGG_ENTRIES);
+	LOG(INFO, "  -i interval  seconds between two drains in aggregate mode, snapshot after (default 1)");
+}
+
+static int parse_args(int argc, char *argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "aowm:b:lG:f:F:e:Ss:A:i:c:Lh")) != -1) {
+		switch (opt) {
+		case 'a':
+			env.aggregate = true;
+			break;
+		case 'o':
+			env.offcpu = true;
+			env.aggregate = true;
+			break;
+		case 'w':
+			env.wall = true;
+			env.offcpu = true;
+			env.aggregate = true;
+			break;
+		case 'm':
+			env.alloc_sym = optarg;
+			break;
+		case 'b':
+			env.alloc_bytes = strtoull(optarg, NULL, 0);
+			if (env.alloc_bytes == 0) {
+				LOG(ERROR, "invalid sample bytes: %s", optarg);
+				return -1;
+			}
+			break;
+		case 'l':
+			env.live = true;
+			env.aggregate = true;
+			break;
+		case 'G':
+			env.gc = true;
+			env.gc_min_us = strtoull(optarg, NULL, 0);
+			break;
+		case 'f': {
+			lat_func_t f;
+			const char *colon = strrchr(optarg, ':');
+			if (colon == NULL || colon == optarg || colon - optarg >= sizeof(f.chunk)) {
+				LOG(ERROR, "invalid function, want chunk:line: %s", optarg);
+				return -1;
+			}
+			memcpy(f.chunk, optarg, colon - optarg);
+			f.chunk[colon - optarg] = '\0';
+			f.linedefined = atoi(colon + 1);
+			VECTOR_PUSH(lat_func_t, &env.lat_funcs, f);
+			break;
+		}
+		case 'F':
+			env.freq = atoi(optarg);
+			if (env.freq <= 0) {
+				LOG(ERROR, "invalid frequency: %s", optarg);
+				return -1;
+			}
+			break;
+		case 'e':
+			env.event = NULL;
+			for (int i = 0; i < sizeof(sw_events) / sizeof(sw_events[0]); i++) {
+				if (strcmp(sw_events[i].name, optarg) == 0) {
+					env.event = &sw_events[i];
+				}
+			}
+			if (env.event == NULL) {
+				LOG(ERROR, "unknown event: %s", optarg);
+				return -1;
+			}
+			break;
+		case 'S':
+			env.snapshot = true;
+			break;
+		case 's':
+			env.service = optarg;
+			break;
+		case 'c':
+			env.cgroup = optarg;
+			break;
+		case 'L':
+			env.all_lua = true;
+			break;
+		case 'A':
+			env.agg_entries = strtoul(optarg, NULL, 0);
+			if (env.agg_entries == 0) {
+				LOG(ERROR, "invalid stack map size: %s", optarg);
+				return -1;
+			}
+			break;
+		case 'i':
+			env.interval = atoi(optarg);
+			if (env.interval <= 0) {
+				LOG(ERROR, "invalid interval: %s", optarg);
+				return -1;
+			}
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	for (int i = optind; i < argc; i++) {
+		int pid = atoi(argv[i]);
+		if (pid <= 0) {
+			LOG(ERROR, "invalid pid: %s", argv[i]);
+			return -1;
+		}
+		VECTOR_PUSH(int, &env.pids, pid);
+	}
+
+	if (env.wall && env.event->config != PERF_COUNT_SW_CPU_CLOCK) {
+		LOG(ERROR, "wall-clock mode samples the cpu clock");
+		return -1;
+	}
+
+#ifndef LUASKY
+	if (env.service) {
+		LOG(ERROR, "-s needs a skynet build (make LUA=-DLUASKY)");
+		return -1;
+	}
+#endif
+
+	if (env.live && !env.alloc_sym) {
+		LOG(ERROR, "-l needs the allocator given by -m");
+		return -1;
+	}
+
+	if (VECTOR_GET_SIZE(int, &env.pids) == 0 && !env.cgroup && !env.all_lua) {
+		LOG(INFO, "Need Process PID to trace\n");
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	VECTOR_INIT(int, &env.pids);
+	VECTOR_INIT(lat_func_t, &env.lat_funcs);
+	VECTOR_INIT(unsigned int, &lat_pending);
+	if (parse_args(argc, argv) < 0) {
+		usage(argv[0]);
+		return -1;
+	}
 
 	signal(SIGINT, sig_handler);
 	signal(SIGTERM, sig_handler);
+	signal(SIGUSR1, report_handler);
 
-	VECTOR_INIT(proc_stack_t, &proclist);
+	VECTOR_INIT(char, &proclist);
+	VECTOR_INIT(char, &proclist_old);
+	VECTOR_INIT(stack_index_t, &stack_index);
+	unwind_tables_init(&tables);
+	uprobes_init(&uprobes);
+	VECTOR_INIT(perf_item_t, &perf_events);
+	lualine_init();
+	skynet_init();
 
 	int err;
     struct ring_buffer *ring_buf = NULL;
     struct stack_bpf *obj;
-	int *pefds = NULL;
-	struct bpf_link **links = NULL;
+	struct bpf_link *offcpu_link = NULL;
 	int num_cpus = libbpf_num_possible_cpus();
 	if (num_cpus <= 0) {
 		LOG(ERROR, "Fail to get the number of processors\n");
 		goto cleanup;
 	}
 
-	pefds = malloc(num_cpus * sizeof(int));
-	for (int i = 0; i < num_cpus; i++) {
-		pefds[i] = -1;
-	}
-
-	links = calloc(num_cpus, sizeof(struct bpf_link *));
-
     libbpf_set_print(libbpf_print_fn);
 
 	obj = stack_bpf__open();
@@ -278,14 +1121,47 @@ int main(int argc, char const *argv[]) {
 		goto cleanup;
 	}
 
-    int pid = atoi(argv[1]);
-    err = unwind_init(obj, pid);
+	obj->bss->aggregate_mode = env.aggregate;
+	obj->bss->wall_mode = env.wall;
+	obj->bss->alloc_sample_bytes = env.alloc_bytes;
+	obj->bss->live_mode = env.live;
+	obj->bss->gc_min_ns = env.gc_min_us * 1000;
+	if (env.agg_entries == 0) {
+		env.agg_entries = keep_stacks() ? KEEP_AGG_ENTRIES : AGG_ENTRIES;
+	}
+	bpf_map__set_max_entries(obj->maps.stack_agg_map, env.agg_entries);
+	bpf_program__set_autoload(obj->progs.profile, cpu_sampling());
+	bpf_program__set_autoload(obj->progs.offcpu, env.offcpu);
+	bpf_program__set_autoload(obj->progs.lua_alloc, env.alloc_sym != NULL);
+	bpf_program__set_autoload(obj->progs.lua_alloc_ret, env.live);
+	bpf_program__set_autoload(obj->progs.gc_enter, env.gc);
+	bpf_program__set_autoload(obj->progs.gc_exit, env.gc);
+	bpf_program__set_autoload(obj->progs.snap_state, env.snapshot);
+#ifdef LUASKY
+	bpf_program__set_autoload(obj->progs.sky_dispatch, !env.snapshot);
+	bpf_program__set_autoload(obj->progs.sky_dispatch_ret, !env.snapshot);
+#else
+	bpf_program__set_autoload(obj->progs.sky_dispatch, false);
+	bpf_program__set_autoload(obj->progs.sky_dispatch_ret, false);
+#endif
+	bool lat = VECTOR_GET_SIZE(lat_func_t, &env.lat_funcs) > 0;
+	bpf_program__set_autoload(obj->progs.lat_precall, lat);
+	bpf_program__set_autoload(obj->progs.lat_precall_ret, lat);
+	bpf_program__set_autoload(obj->progs.lat_poscall, lat);
+#if (defined LUA54 || defined LUASKY)
+	bpf_program__set_autoload(obj->progs.lat_execute, lat);
+	bpf_program__set_autoload(obj->progs.lat_execute_ret, lat);
+#else
+	bpf_program__set_autoload(obj->progs.lat_execute, false);
+	bpf_program__set_autoload(obj->progs.lat_execute_ret, false);
+#endif
+	err = load_targets(&tables);
 	if (err < 0) {
 		goto cleanup;
 	}
 
-	stack_map_fd = bpf_map__fd(obj->maps.proc_stack_map);
-	if (stack_map_fd < 0) {
+    err = upload_unwind_tables(obj, &tables);
+	if (err < 0) {
 		goto cleanup;
 	}
 
@@ -295,10 +1171,57 @@ int main(int argc, char const *argv[]) {
 		goto cleanup;
 	}
 
-    err = start_profile(obj, pefds, links, num_cpus);
-    if (err < 0) {
-        goto cleanup;
-    }
+	if (env.offcpu) {
+		offcpu_link = bpf_program__attach(obj->progs.offcpu);
+		if (!offcpu_link) {
+			LOG(ERROR, "failed to attach sched_switch\n");
+			goto cleanup;
+		}
+	}
+
+	if (env.alloc_sym && uprobes_attach(&uprobes, obj->progs.lua_alloc, false, &tables, env.alloc_sym) == 0) {
+		LOG(ERROR, "%s not found in the profiled processes", env.alloc_sym);
+		goto cleanup;
+	}
+
+	if (env.live && uprobes_attach(&uprobes, obj->progs.lua_alloc_ret, true, &tables, env.alloc_sym) == 0) {
+		LOG(ERROR, "attach the return of %s failed", env.alloc_sym);
+		goto cleanup;
+	}
+
+	if (env.gc && attach_gc_probes(obj) <= 0) {
+		LOG(ERROR, "no gc function found in the profiled processes");
+		goto cleanup;
+	}
+
+	if (lat && attach_lat_probes(obj) < 0) {
+		LOG(ERROR, "luaD_precall or luaD_poscall not found in the profiled processes");
+		goto cleanup;
+	}
+
+#ifdef LUASKY
+	if (!env.snapshot) {
+		err = attach_sky_probes(obj);
+		if (err < 0) {
+			goto cleanup;
+		}
+		if (err == 0) {
+			LOG(WARN, "no snlua callback found, stacks are not split by service");
+		}
+	}
+#endif
+
+	if (env.snapshot && uprobes_attach(&uprobes, obj->progs.snap_state, false, &tables, "luaV_execute") == 0) {
+		LOG(ERROR, "luaV_execute not found in the profiled processes");
+		goto cleanup;
+	}
+
+	if (cpu_sampling()) {
+		err = start_profile(obj, num_cpus);
+		if (err < 0) {
+			goto cleanup;
+		}
+	}
 
 	#if (defined LUA54 || defined LUASKY)
 		LOG(INFO, "current trace is lua5.4");
@@ -307,47 +1230,106 @@ int main(int argc, char const *argv[]) {
 	#endif
 
 	/* Wait and receive stack traces */
+	unsigned long long next_drain = get_ktime_ns() + env.interval * NSEC_PER_SEC;
+	unsigned long long next_stat = get_ktime_ns() + STAT_INTERVAL * NSEC_PER_SEC;
 	while (!exiting) {
 		err = ring_buffer__poll(ring_buf, 100 /* timeout, ms */);
-		/* Ctrl-C will cause -EINTR */
+		/* Ctrl-C will cause -EINTR, so does SIGUSR1 */
 		if (err == -EINTR) {
 			err = 0;
+			if (exiting) {
+				break;
+			}
+		} else if (err < 0) {
 			break;
 		}
-		if (err < 0) {
+
+		if (lat) {
+			update_lat_filter(obj);
+		}
+
+		if (report) {
+			report = 0;
+			if (env.live) {
+				report_live_heap(obj);
+			}
+		}
+
+		if (get_ktime_ns() >= next_stat) {
+			print_stats(obj, num_cpus);
+			next_stat = get_ktime_ns() + STAT_INTERVAL * NSEC_PER_SEC;
+		}
+
+		// the states that ran lua are known, take the snapshot
+		if (env.snapshot && get_ktime_ns() >= next_drain) {
 			break;
 		}
+
+		if (env.aggregate && !keep_stacks() && get_ktime_ns() >= next_drain) {
+			drain_stack_agg(obj, true);
+			next_drain = get_ktime_ns() + env.interval * NSEC_PER_SEC;
+		}
 	}
 
-	LOG(INFO, "run end\n");
-	LOG(INFO, "write file: %s ...", PERF_FILE);
+	if (env.offcpu) {
+		bpf_link__destroy(offcpu_link);
+		offcpu_link = NULL;
+		charge_offcpu_pending(obj);
+	}
 
-	if (vec_cyc) {
-		VECTOR_RESIZE(proc_stack_t, &proclist, COLLECT_MAX_SIZE);
+	if (env.live) {
+		VECTOR_CLEAR(char, &proclist);
+		VECTOR_CLEAR(stack_index_t, &stack_index);
 	}
 
-	fgraph_init(PERF_FILE);
-	fgraph_output(&proclist, pid, procname);
-	fgraph_free();
-	LOG(INFO, "write %s file end\n", PERF_FILE);
+	if (env.aggregate) {
+		drain_stack_agg(obj, true);
+	}
 
-cleanup:
-	VECTOR_FREE(proc_stack_t, &proclist);
+	if (env.snapshot) {
+		uprobes_free(&uprobes);
+		uprobes_init(&uprobes);
+		print_snapshot(obj);
+		goto cleanup;
+	}
 
-	if (links) {
-		for (int cpu = 0; cpu < num_cpus; cpu++) {
-			bpf_link__destroy(links[cpu]);
-		}
-		free(links);
+	LOG(INFO, "run end\n");
+	print_stats(obj, num_cpus);
+	if (env.gc) {
+		print_gc_hist(obj);
+	}
+	if (lat) {
+		print_lat_hist(obj);
 	}
 
-	if (pefds) {
-		for (int i = 0; i < num_cpus; i++) {
-			if (pefds[i] >= 0)
-				close(pefds[i]);
-		}
-		free(pefds);
+	if (vec_cyc) {
+		VECTOR_APPEND(char, &proclist_old, proclist.vector, VECTOR_GET_SIZE(char, &proclist));
+		VECTOR_TYPE(char) tmp = proclist;
+		proclist = proclist_old;
+		proclist_old = tmp;
+	}
+
+	write_perf_file(obj);
+
+cleanup:
+	VECTOR_FREE(char, &proclist);
+	VECTOR_FREE(char, &proclist_old);
+	VECTOR_FREE(stack_index_t, &stack_index);
+	VECTOR_FREE(int, &env.pids);
+	VECTOR_FREE(lat_func_t, &env.lat_funcs);
+	VECTOR_FREE(unsigned int, &lat_pending);
+	unwind_tables_free(&tables);
+	lualine_free();
+	skynet_free();
+
+	bpf_link__destroy(offcpu_link);
+	uprobes_free(&uprobes);
+
+	VECTOR_FOR_EACH_PTR(perf_item_t, pe, &perf_events) {
+		bpf_link__destroy(pe->link);
+		close(pe->fd);
 	}
+	VECTOR_FREE(perf_item_t, &perf_events);
 
     ring_buffer__free(ring_buf);
     stack_bpf__destroy(obj);
@@ -0,0 +1,41 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "targetmem.h"
+
+
+#if (defined LUA54 || defined LUASKY)
+#include "luaref54.h"
+#else
+#include "luaref53.h"
+#endif
+
+
+int read_target(int pid, void *dst, const void *src, size_t sz) {
+	struct iovec local = { .iov_base = dst, .iov_len = sz };
+	struct iovec remote = { .iov_base = (void *)src, .iov_len = sz };
+	ssize_t n = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+	return n == (ssize_t)sz ? 0 : -1;
+}
+
+int read_target_tstring(int pid, const void *ts, char *buf, size_t sz) {
+	TString tmp;
+	buf[0] = '\0';
+	if (ts == NULL || read_target(pid, &tmp, ts, sizeof(tmp)) < 0) {
+		return -1;
+	}
+
+	size_t len = tsslen(&tmp);
+	if (len >= sz) {
+		len = sz - 1;
+	}
+	if (read_target(pid, buf, getstr((TString *)ts), len) < 0) {
+		buf[0] = '\0';
+		return -1;
+	}
+	buf[len] = '\0';
+	return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef TARGETMEM_H
+#define TARGETMEM_H
+
+#include <stddef.h>
+
+
+// copy sz bytes at src in the memory of process pid to dst, 0 on success
+int read_target(int pid, void *dst, const void *src, size_t sz);
+// copy the lua string at ts in process pid to buf as a c string, cut to fit.
+// buf is empty and -1 is returned when it can not be read
+int read_target_tstring(int pid, const void *ts, char *buf, size_t sz);
+
+#endif
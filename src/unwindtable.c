@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "unwindtable.h"
+#include "dwarfunwind.h"
+#include "logger.h"
+
+
+// a coalesced row, length is only needed to coalesce, end to build the page index
+typedef struct row_item_t {
+	unwind_row_t row;
+	unsigned long length;
+	unsigned long end; // end of the last FDE the row is in
+} row_item_t;
+
+
+static int cmp_func(const void * a, const void * b) {
+	precomputed_unwind_t *unwinda = (precomputed_unwind_t *)a;
+	precomputed_unwind_t *unwindb = (precomputed_unwind_t *)b;
+	return (unwinda->ip > unwindb->ip) ? 1 : -1;
+}
+
+// keep only the rules the bpf unwinder evaluates
+static void pack_unwind_state(const dwarf_state_t *state, unsigned int lreg, fde_state_t *out) {
+	static const unsigned int regs[UNWIND_RULES] = { DWARF_RBP, DWARF_RIP, 0 };
+
+	memset(out, 0, sizeof(*out));
+	out->cfa_offset = state->cfa_offset;
+	out->cfa_register = state->cfa_register;
+	out->cfa_rule = CFA_RULE_REG;
+
+	if (state->cfa_expression != NULL) {
+		dwarf_expr_rule_t rule;
+		out->cfa_rule = CFA_RULE_UNKNOWN;
+		if (!dwarf_compile_cfa_expr(state->cfa_expression, state->cfa_expression_length, &rule)
+				&& (rule.reg == DWARF_RSP || rule.reg == DWARF_RBP)) {
+			out->cfa_rule = rule.rule;
+			out->cfa_register = rule.reg;
+			out->cfa_offset = rule.offset;
+			out->cfa_arg = rule.arg;
+		}
+	}
+
+	for (int i = 0; i < UNWIND_RULES; i++) {
+		unsigned int reg = i == UNWIND_RULE_LREG ? lreg : regs[i];
+		if (reg >= DWARF_REGS) {
+			continue;
+		}
+		out->rule_from[i] = state->saved_registers[reg].from;
+		out->rule_value[i] = state->saved_registers[reg].value;
+
+		if (out->rule_from[i] == REG_ATEXP || out->rule_from[i] == REG_ISEXP) {
+			unsigned int base;
+			long offset;
+			out->rule_reg[i] = DWARF_REGS; // not evaluable
+			out->rule_value[i] = 0;
+			if (!dwarf_compile_reg_expr(state->saved_registers[reg].expression,
+					state->saved_registers[reg].expression_length, &base, &offset)) {
+				out->rule_reg[i] = base;
+				out->rule_value[i] = offset;
+			}
+		}
+	}
+}
+
+// id of state in the shared state table
+static unsigned int intern_unwind_state(unwind_tables_t *t, const fde_state_t *state) {
+	size_t sz = VECTOR_GET_SIZE(unsigned int, &t->state_index);
+	size_t lo = 0, hi = sz;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		unsigned int id = VECTOR_GET(unsigned int, &t->state_index, mid);
+		int c = memcmp(VECTOR_GET_PTR(fde_state_t, &t->states, id), state, sizeof(*state));
+		if (c == 0) {
+			return id;
+		}
+		if (c < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	unsigned int id = VECTOR_GET_SIZE(fde_state_t, &t->states);
+	VECTOR_PUSH_PTR(fde_state_t, &t->states, state);
+	VECTOR_PUSH(unsigned int, &t->state_index, id);
+	unsigned int *data = VECTOR_DATA(unsigned int, &t->state_index);
+	memmove(data + lo + 1, data + lo, (sz - lo) * sizeof(unsigned int));
+	data[lo] = id;
+	return id;
+}
+
+// rows must be sorted by ip, adjacent rows with the same state are merged
+static void build_unwind_rows(unwind_tables_t *t, VECTOR_TYPE(precomputed_unwind_t) *precomputed_unwinds,
+			unsigned int lreg, VECTOR_TYPE(row_item_t) *rows) {
+	fde_state_t state;
+
+	VECTOR_FOR_EACH_PTR(precomputed_unwind_t, u, precomputed_unwinds) {
+		pack_unwind_state(&u->state, lreg, &state);
+		unsigned int id = intern_unwind_state(t, &state);
+
+		size_t n = VECTOR_GET_SIZE(row_item_t, rows);
+		row_item_t *back = n > 0 ? VECTOR_GET_BACK_PTR(row_item_t, rows) : NULL;
+		if (back && back->row.state == id && back->row.ip + back->length == u->ip) {
+			back->length += u->length;
+			back->end = u->end;
+			continue;
+		}
+
+		row_item_t item = {
+			.row = { .ip = u->ip, .state = id },
+			.length = u->length,
+			.end = u->end,
+		};
+		VECTOR_PUSH(row_item_t, rows, item);
+	}
+}
+
+// every page a row overlaps points at it. a row ends at the next row or the end
+// of its FDE, whichever comes first, so the pages come out in order and never
+// leave the FDE. base is the index of rows[0] in the shared row table
+static void build_unwind_pages(unwind_tables_t *t, unsigned int obj, VECTOR_TYPE(row_item_t) *rows,
+			unsigned int base, int fp_safe) {
+	size_t size = VECTOR_GET_SIZE(row_item_t, rows);
+	size_t first_page = VECTOR_GET_SIZE(page_item_t, &t->pages);
+	size_t outside = 0;
+
+	for (unsigned int index = 0; index < size; index++) {
+		row_item_t *u = VECTOR_GET_PTR(row_item_t, rows, index);
+		fde_state_t *state = VECTOR_GET_PTR(fde_state_t, &t->states, u->row.state);
+		unsigned char lfrom = state->rule_from[UNWIND_RULE_LREG];
+		int keeps_lreg = lfrom == REG_UNUSED || lfrom == REG_SAME;
+
+		unsigned long ip = u->row.ip;
+		if (ip >= u->end) {
+			outside++;
+			continue;
+		}
+		unsigned long end = u->end;
+		if (index + 1 < size) {
+			unsigned long next = VECTOR_GET(row_item_t, rows, index + 1).row.ip;
+			if (next < end) {
+				end = next;
+			}
+		}
+		// a later row at the same ip replaces this one
+		if (end <= ip) {
+			continue;
+		}
+		unsigned long long first = ip >> UNWIND_PAGE_SHIFT;
+		unsigned long long last = (end - 1) >> UNWIND_PAGE_SHIFT;
+
+		for (unsigned long long p = first; p <= last; p++) {
+			size_t n = VECTOR_GET_SIZE(page_item_t, &t->pages);
+			page_item_t *back = n > first_page ? VECTOR_GET_BACK_PTR(page_item_t, &t->pages) : NULL;
+			if (back && back->key.page == p) {
+				back->rows.count = base + index - back->rows.first + 1;
+				if (!keeps_lreg) {
+					back->rows.flags &= ~UNWIND_PAGE_FP;
+				}
+				continue;
+			}
+
+			page_item_t item = {
+				.key = { .obj = obj, .page = p },
+				.rows = { .first = base + index, .count = 1 },
+			};
+			if (keeps_lreg && fp_safe) {
+				item.rows.flags = UNWIND_PAGE_FP;
+			}
+			VECTOR_PUSH(page_item_t, &t->pages, item);
+		}
+	}
+
+	if (outside > 0) {
+		LOG(WARN, "     %zu rows start past the end of their fde, not indexed", outside);
+	}
+}
+
+// find luaV_execute in the mappings of a process, 0 when found
+static int find_lua_execute(running_maps_t *maps, luaV_execute_t *lt) {
+	memset(lt, 0, sizeof(*lt));
+	for (int i = 0; i < maps->count; i++) {
+		map_item_t *item = &maps->item[i];
+		const Elf64_Sym *lsym = find_symname_address(&item->elf, "luaV_execute");
+		if (lsym == NULL) {
+			continue;
+		}
+
+		lt->ip_start = lsym->st_value + item->addr_start - item->addr_offset;
+		lt->ip_end = lt->ip_start + lsym->st_size;
+		if (!find_func_reg1(item->elf.map, lsym->st_value, lsym->st_size, &lt->lstate)) {
+			LOG(INFO, "find luaV_execute param, type: %d, reg: %u, offset: %d",
+				lt->lstate.type, lt->lstate.reg, lt->lstate.offset);
+		}
+		LOG(INFO, "=== luaV_execute %lx <%lx-%lx>\n", (unsigned long)lsym->st_value, lt->ip_start, lt->ip_end);
+		return 0;
+	}
+	return -1;
+}
+
+static object_item_t *find_object(unwind_tables_t *t, map_item_t *item, unsigned int lreg) {
+	VECTOR_FOR_EACH_PTR(object_item_t, o, &t->objects) {
+		if (o->dev == item->dev && o->inode == item->inode && o->lreg == lreg) {
+			return o;
+		}
+	}
+	return NULL;
+}
+
+// parse the .eh_frame of a mapped file into object relative rows
+static unsigned int load_object(unwind_tables_t *t, map_item_t *item, unsigned int lreg) {
+    dwarf_unwind_info_t dinfo;
+	VECTOR_TYPE(row_item_t) rows;
+	unsigned long bias = item->addr_start - item->addr_offset;
+	unsigned int id = VECTOR_GET_SIZE(object_item_t, &t->objects);
+
+    memset(&dinfo, 0, sizeof(dinfo));
+    init_dwarf_unwind_info(&dinfo);
+	VECTOR_INIT(row_item_t, &rows);
+
+	dinfo.item = item;
+	load_dwarf_unwind_information(&dinfo);
+
+	// the mapping qualifies for the frame pointer walk only if every row does
+	int fp_safe = VECTOR_GET_SIZE(precomputed_unwind_t, &dinfo.precomputed_unwinds) > 0;
+	VECTOR_FOR_EACH_PTR(precomputed_unwind_t, u, &dinfo.precomputed_unwinds) {
+		u->ip -= bias;
+		u->end -= bias;
+		fp_safe = fp_safe && dwarf_state_fp_safe(&u->state);
+	}
+
+	qsort(dinfo.precomputed_unwinds.vector, VECTOR_GET_SIZE(precomputed_unwind_t, &dinfo.precomputed_unwinds),
+		sizeof(precomputed_unwind_t), cmp_func);
+
+	unsigned int base = VECTOR_GET_SIZE(unwind_row_t, &t->rows);
+	size_t first_page = VECTOR_GET_SIZE(page_item_t, &t->pages);
+	build_unwind_rows(t, &dinfo.precomputed_unwinds, lreg, &rows);
+	build_unwind_pages(t, id, &rows, base, fp_safe);
+	VECTOR_FOR_EACH_PTR(row_item_t, r, &rows) {
+		VECTOR_PUSH(unwind_row_t, &t->rows, r->row);
+	}
+
+	LOG(INFO, "     rows: %zu, coalesced: %zu, pages: %zu%s",
+		VECTOR_GET_SIZE(precomputed_unwind_t, &dinfo.precomputed_unwinds), VECTOR_GET_SIZE(row_item_t, &rows),
+		VECTOR_GET_SIZE(page_item_t, &t->pages) - first_page, fp_safe ? ", frame pointer safe" : "");
+
+	object_item_t obj = {
+		.dev = item->dev,
+		.inode = item->inode,
+		.lreg = lreg,
+		.id = id,
+	};
+	VECTOR_PUSH(object_item_t, &t->objects, obj);
+
+	// the rows point into unwind_data for their expressions, free it after packing
+	VECTOR_FOR_EACH_PTR(dwarf_unwind_region_t, u, &dinfo.regions) {
+		free(u->unwind_data);
+	}
+	VECTOR_FREE(precomputed_unwind_t, &dinfo.precomputed_unwinds);
+	VECTOR_FREE(dwarf_unwind_region_t, &dinfo.regions);
+	VECTOR_FREE(row_item_t, &rows);
+	return id;
+}
+
+int unwind_tables_add(unwind_tables_t *t, int pid, int require_lua) {
+    running_maps_t *maps;
+	proc_item_t proc;
+
+	maps = create_maps(pid);
+    if (maps == NULL) {
+        return -1;
+    }
+
+	memset(&proc, 0, sizeof(proc));
+	proc.pid = pid;
+	if (maps->count > 0) {
+		snprintf(proc.name, sizeof(proc.name), "%s", maps->item[0].path);
+	}
+
+	if (find_lua_execute(maps, &proc.info.lt) < 0 && require_lua) {
+		free_maps(maps);
+		return 1;
+	}
+
+    LOG(INFO, "pid: %d\n", pid);
+
+	unsigned int lreg = proc.info.lt.lstate.reg;
+	proc.info.first_mapping = VECTOR_GET_SIZE(proc_mapping_t, &t->mappings);
+    for (int i = 0; i < maps->count; i++) {
+        map_item_t *item = &maps->item[i];
+        LOG(INFO, "---> %s (%lx-%lx  %lx)", item->path, item->addr_start, item->addr_end, item->addr_offset);
+
+		if (proc.info.mapping_count >= (1 << MAX_MAPPING_SEARCH) - 1) {
+			LOG(WARN, "too many mappings in %d, skip %s", pid, item->path);
+			continue;
+		}
+
+		object_item_t *obj = find_object(t, item, lreg);
+		proc_mapping_t mapping = {
+			.start = item->addr_start,
+			.end = item->addr_end,
+			.bias = item->addr_start - item->addr_offset,
+			.obj = obj ? obj->id : load_object(t, item, lreg),
+		};
+		VECTOR_PUSH(proc_mapping_t, &t->mappings, mapping);
+		proc.info.mapping_count++;
+    }
+	VECTOR_PUSH(proc_item_t, &t->procs, proc);
+
+    free_maps(maps);
+	return 0;
+}
+
+const char *unwind_tables_proc_name(unwind_tables_t *t, int pid) {
+	VECTOR_FOR_EACH_PTR(proc_item_t, p, &t->procs) {
+		if (p->pid == pid) {
+			return p->name;
+		}
+	}
+	return "-";
+}
+
+void unwind_tables_init(unwind_tables_t *t) {
+	VECTOR_INIT(unwind_row_t, &t->rows);
+	VECTOR_INIT(fde_state_t, &t->states);
+	VECTOR_INIT(unsigned int, &t->state_index);
+	VECTOR_INIT(page_item_t, &t->pages);
+	VECTOR_INIT(object_item_t, &t->objects);
+	VECTOR_INIT(proc_mapping_t, &t->mappings);
+	VECTOR_INIT(proc_item_t, &t->procs);
+}
+
+void unwind_tables_free(unwind_tables_t *t) {
+	VECTOR_FREE(unwind_row_t, &t->rows);
+	VECTOR_FREE(fde_state_t, &t->states);
+	VECTOR_FREE(unsigned int, &t->state_index);
+	VECTOR_FREE(page_item_t, &t->pages);
+	VECTOR_FREE(object_item_t, &t->objects);
+	VECTOR_FREE(proc_mapping_t, &t->mappings);
+	VECTOR_FREE(proc_item_t, &t->procs);
+}
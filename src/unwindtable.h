@@ -0,0 +1,52 @@
+#ifndef UNWIND_TABLE_H
+#define UNWIND_TABLE_H
+
+#include "common.h"
+#include "elf.h"
+#include "vector.h"
+
+
+// key and value of fde_page_map
+typedef struct page_item_t {
+	unwind_page_key_t key;
+	unwind_page_t rows;
+} page_item_t;
+
+// a profiled process, info goes to proc_info_map
+typedef struct proc_item_t {
+	int pid;
+	char name[MAP_PATH_MAX];
+	proc_info_t info;
+} proc_item_t;
+
+// a mapped file whose rows are loaded. the packed states depend on the
+// register luaV_execute keeps lua_State in, so it is part of the identity
+typedef struct object_item_t {
+	unsigned long dev;
+	unsigned long inode;
+	unsigned int lreg;
+	unsigned int id;
+} object_item_t;
+
+// unwind tables of every profiled process, built before the bpf object is
+// loaded so the maps can be sized. rows are loaded once per object with
+// object relative addresses, processes only add their mappings
+typedef struct unwind_tables_t {
+	VECTOR_TYPE(unwind_row_t) rows;
+	VECTOR_TYPE(fde_state_t) states;
+	VECTOR_TYPE(unsigned int) state_index; // states sorted by content
+	VECTOR_TYPE(page_item_t) pages;
+	VECTOR_TYPE(object_item_t) objects;
+	VECTOR_TYPE(proc_mapping_t) mappings;
+	VECTOR_TYPE(proc_item_t) procs;
+} unwind_tables_t;
+
+
+void unwind_tables_init(unwind_tables_t *t);
+void unwind_tables_free(unwind_tables_t *t);
+// parse the mappings of pid and append its rows, returns 1 when require_lua is
+// set and the process has no luaV_execute
+int unwind_tables_add(unwind_tables_t *t, int pid, int require_lua);
+const char *unwind_tables_proc_name(unwind_tables_t *t, int pid);
+
+#endif
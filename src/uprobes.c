@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "uprobes.h"
+#include "uprobe_helpers.h"
+#include "logger.h"
+
+
+// a binary is one file whatever path or mount namespace it is mapped from
+typedef struct uprobe_file_t {
+	dev_t dev;
+	ino_t ino;
+} uprobe_file_t;
+
+static int seen_file(VECTOR_TYPE(uprobe_file_t) *seen, const struct stat *st) {
+	VECTOR_FOR_EACH_PTR(uprobe_file_t, p, seen) {
+		if (p->dev == st->st_dev && p->ino == st->st_ino) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// try every executable file mapping of pid that has not been tried yet, only
+// the files named file when it is set
+static int attach_pid(uprobes_t *u, struct bpf_program *prog, bool retprobe, int pid,
+		const char *sym, const char *file, VECTOR_TYPE(uprobe_file_t) *seen) {
+	char line[512];
+	char path[MAP_PATH_MAX];
+	char root_path[ROOT_PATH_MAX];
+	char perm[5];
+	struct stat st;
+	int count = 0;
+
+	snprintf(line, sizeof(line), "/proc/%d/maps", pid);
+	FILE *f = fopen(line, "r");
+	if (f == NULL) {
+		LOG(WARN, "cannot open %s: %s", line, strerror(errno));
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%*x-%*x %4s %*x %*x:%*x %*u %127[^\t\n]", perm, path) < 2) {
+			continue;
+		}
+		if (perm[2] != 'x' || path[0] != '/') {
+			continue;
+		}
+		if (file && strcmp(strrchr(path, '/') + 1, file) != 0) {
+			continue;
+		}
+		proc_root_path(pid, path, root_path, sizeof(root_path));
+		if (stat(root_path, &st) < 0 || seen_file(seen, &st)) {
+			continue;
+		}
+		uprobe_file_t item = { .dev = st.st_dev, .ino = st.st_ino };
+		VECTOR_PUSH(uprobe_file_t, seen, item);
+
+		off_t off = get_elf_func_offset(root_path, sym);
+		if (off < 0) {
+			continue;
+		}
+
+		struct bpf_link *link = bpf_program__attach_uprobe(prog, retprobe, -1, root_path, off);
+		if (!link) {
+			LOG(WARN, "attach %s in %s failed: %s", sym, root_path, strerror(errno));
+			continue;
+		}
+		LOG(INFO, "attach %s%s in %s", retprobe ? "ret " : "", sym, root_path);
+		VECTOR_PUSH(struct bpf_link *, &u->links, link);
+		count++;
+	}
+
+	fclose(f);
+	return count;
+}
+
+int uprobes_attach_file(uprobes_t *u, struct bpf_program *prog, bool retprobe,
+		unwind_tables_t *t, const char *sym, const char *file) {
+	VECTOR_TYPE(uprobe_file_t) seen;
+	int count = 0;
+
+	VECTOR_INIT(uprobe_file_t, &seen);
+	VECTOR_FOR_EACH_PTR(proc_item_t, p, &t->procs) {
+		count += attach_pid(u, prog, retprobe, p->pid, sym, file, &seen);
+	}
+	VECTOR_FREE(uprobe_file_t, &seen);
+	return count;
+}
+
+int uprobes_attach(uprobes_t *u, struct bpf_program *prog, bool retprobe,
+		unwind_tables_t *t, const char *sym) {
+	return uprobes_attach_file(u, prog, retprobe, t, sym, NULL);
+}
+
+void uprobes_init(uprobes_t *u) {
+	VECTOR_INIT(struct bpf_link *, &u->links);
+}
+
+void uprobes_free(uprobes_t *u) {
+	VECTOR_FOR_EACH_PTR(struct bpf_link *, link, &u->links) {
+		bpf_link__destroy(*link);
+	}
+	VECTOR_FREE(struct bpf_link *, &u->links);
+}
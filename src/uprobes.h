@@ -0,0 +1,30 @@
+#ifndef UPROBES_H
+#define UPROBES_H
+
+#include <stdbool.h>
+#include <bpf/libbpf.h>
+
+#include "unwindtable.h"
+#include "vector.h"
+
+
+// uprobes on a function of the profiled processes. every binary that defines
+// the symbol gets one probe shared by all processes mapping it, bpf tells the
+// processes apart through proc_info_map
+typedef struct uprobes_t {
+	VECTOR_TYPE(struct bpf_link *) links;
+} uprobes_t;
+
+
+void uprobes_init(uprobes_t *u);
+void uprobes_free(uprobes_t *u);
+// attach prog to sym in the binaries of every process of t, returns the number
+// of binaries it was attached in
+int uprobes_attach(uprobes_t *u, struct bpf_program *prog, bool retprobe,
+		unwind_tables_t *t, const char *sym);
+// same, only in the binaries whose file name is file, for symbols as common
+// as static callbacks
+int uprobes_attach_file(uprobes_t *u, struct bpf_program *prog, bool retprobe,
+		unwind_tables_t *t, const char *sym, const char *file);
+
+#endif
@@ -27,6 +27,21 @@ void add_vector_element(vector_t *vector, char *item, size_t size) {
     vector->used ++;
 }
 
+void append_vector_elements(vector_t *vector, const char *items, size_t size, size_t count) {
+    if(vector->used + count > vector->alloc) {
+        size_t alloc = vector->alloc ? vector->alloc : INITIAL_VECTOR_SIZE;
+        while(alloc < vector->used + count) {
+            alloc *= 2;
+        }
+        vector->alloc = alloc;
+        vector->vector = realloc(vector->vector, vector->alloc * size);
+    }
+
+    memcpy((char *)vector->vector + vector->used * size, items, count * size);
+
+    vector->used += count;
+}
+
 void *add_get_vector_element(vector_t *vector, size_t size) {
     if(vector->used >= vector->alloc) {
         vector->alloc
@@ -11,6 +11,7 @@ void init_vector(vector_t *vector);
 void free_vector(vector_t *vector);
 
 void add_vector_element(vector_t *vector, char *item, size_t size);
+void append_vector_elements(vector_t *vector, const char *items, size_t size, size_t count);
 void *add_get_vector_element(vector_t *vector, size_t size);
 void pop_vector_element(vector_t *vector);
 void preallocate_vector(vector_t *vector, size_t size, size_t count);
@@ -23,6 +24,8 @@ void clone_vector(vector_t *vector, vector_t *clone, size_t size);
 #define VECTOR_FREE(type, vector)           free_vector(vector)
 #define VECTOR_PUSH(type, vector, item)     add_vector_element(vector, (char *)&item, sizeof(type))
 #define VECTOR_PUSH_PTR(type, vector, item) add_vector_element(vector, (char *)item, sizeof(type))
+#define VECTOR_APPEND(type, vector, items, count) \
+    append_vector_elements(vector, (const char *)(items), sizeof(type), count)
 #define VECTOR_DATA(type, vec)              ((type *)(vec)->vector)
 #define VECTOR_GET(type, vector, i)         (VECTOR_DATA(type, vector)[i])
 #define VECTOR_GET_PTR(type, vector, i)     (&VECTOR_DATA(type, vector)[i])